@@ -34,7 +34,17 @@ Application::Application(AppConfig config, bool gl) {
     config.pathtracer_direct_hemisphere_sample,
     config.pathtracer_filename,
     config.pathtracer_lensRadius,
-    config.pathtracer_focalDistance
+    config.pathtracer_focalDistance,
+    config.pathtracer_bvh_build_method,
+    config.pathtracer_bvh_layout,
+    config.pathtracer_bvh_duplication_budget,
+    config.pathtracer_bvh_instancing,
+    config.pathtracer_bvh_cache_dir,
+    config.pathtracer_bvh_treelets,
+    config.pathtracer_packet_tracing,
+    config.pathtracer_stream_tracing,
+    config.pathtracer_pass_samples,
+    config.pathtracer_time_budget
   );
   filename = config.pathtracer_filename;
 }
@@ -62,6 +62,17 @@ struct AppConfig {
     pathtracer_filename = "";
     pathtracer_lensRadius = 0.0;
     pathtracer_focalDistance = 4.7;
+
+    pathtracer_bvh_build_method = SceneObjects::BVH_BUILD_SAH;
+    pathtracer_bvh_layout = SceneObjects::BVH_LAYOUT_BINARY;
+    pathtracer_bvh_duplication_budget = 0.3;
+    pathtracer_bvh_instancing = false;
+    pathtracer_bvh_cache_dir = "";
+    pathtracer_bvh_treelets = false;
+    pathtracer_packet_tracing = false;
+    pathtracer_stream_tracing = false;
+    pathtracer_pass_samples = 0;
+    pathtracer_time_budget = 0;
   }
 
   size_t pathtracer_ns_aa;
@@ -84,6 +95,17 @@ struct AppConfig {
 
   double pathtracer_lensRadius;
   double pathtracer_focalDistance;
+
+  SceneObjects::BVHBuildMethod pathtracer_bvh_build_method;
+  SceneObjects::BVHLayout pathtracer_bvh_layout;
+  double pathtracer_bvh_duplication_budget;
+  bool pathtracer_bvh_instancing;
+  string pathtracer_bvh_cache_dir;
+  bool pathtracer_bvh_treelets;
+  bool pathtracer_packet_tracing;
+  bool pathtracer_stream_tracing;
+  size_t pathtracer_pass_samples;
+  double pathtracer_time_budget;
 };
 
 class Application : public Renderer {
@@ -111,6 +133,14 @@ class Application : public Renderer {
     renderer->render_to_file(filename, x, y, dx, dy); 
   }
 
+  void report_bvh_stats() {
+    // measured on a scene of its own, as setting the scene of the renderer
+    // builds (and maybe caches) its BVH and moves instanced meshes
+    SceneObjects::Scene *stats_scene = scene->get_static_scene();
+    renderer->report_bvh_stats(stats_scene);
+    delete stats_scene;
+  }
+
   void load_camera(std::string filename) {
     camera.load_settings(filename);
   }
@@ -9,10 +9,13 @@ typedef uint32_t gid_t;
 #include "util/image.h"
 typedef uint32_t gid_t;
 
+#include <cerrno>
+#include <climits>
 #include <iostream>
 #ifdef _WIN32
 #include "util/win32/getopt.h"
 #else
+#include <getopt.h>
 #include <unistd.h>
 #endif
 
@@ -33,6 +36,19 @@ void usage(const char* binaryName) {
   printf("  -d  <FLOAT>      The focal distance\n");
   printf("  -f  <FILENAME>   Image (.png) file to save output to in windowless mode\n");
   printf("  -r  <INT> <INT>  Width and height of output image (if windowless)\n");
+  printf("  -B  <NAME>       BVH build method (median, sah, lbvh, sbvh)\n");
+  printf("  -L  <NAME>       BVH node layout (binary, wide4, wide8, qwide4, qwide8)\n");
+  printf("  -D  <FLOAT>      SBVH reference duplication budget (fraction of primitives)\n");
+  printf("  -I               Two-level BVH, instances of a mesh share one BVH\n");
+  printf("  -C  <PATH>       Directory to cache built BVHs in, reused by later runs\n");
+  printf("  -T               Store wide BVH nodes in page sized treelets (needs a wide -L)\n");
+  printf("  -P               Trace camera and shadow rays in packets\n");
+  printf("  -W               Trace tiles as wavefronts of sorted ray streams\n");
+  printf("  --progressive <INT>  Render in passes adding INT camera rays per pixel\n");
+  printf("  --time-budget <SECONDS>  Stop starting passes once the render would exceed\n");
+  printf("                   SECONDS, up to the -s samples per pixel\n");
+  printf("  --bvh-stats      Compare the BVH builders on the scene and exit\n");
+  printf("  --bench-slabs    Time the ray - box slab tests and exit\n");
   printf("  -h               Print this help message\n");
   printf("\n");
 }
@@ -81,9 +97,19 @@ int main( int argc, char** argv ) {
   // get the options
   AppConfig config; int opt;
   bool write_to_file = false;
+  bool bvh_stats = false;
+  bool bench_slabs = false;
   size_t w = 0, h = 0, x = -1, y = 0, dx = 0, dy = 0;
   string filename, cam_settings = "";
-  while ( (opt = getopt(argc, argv, "s:l:t:m:e:h:H:f:r:c:b:d:a:p:")) != -1 ) {  // for each option...
+  enum { OPT_BVH_STATS = 256, OPT_BENCH_SLABS, OPT_PROGRESSIVE, OPT_TIME_BUDGET };
+  static const struct option long_options[] = {
+    { "bvh-stats", no_argument, NULL, OPT_BVH_STATS },
+    { "bench-slabs", no_argument, NULL, OPT_BENCH_SLABS },
+    { "progressive", required_argument, NULL, OPT_PROGRESSIVE },
+    { "time-budget", required_argument, NULL, OPT_TIME_BUDGET },
+    { NULL, 0, NULL, 0 }
+  };
+  while ( (opt = getopt_long(argc, argv, "s:l:t:m:e:h:H:f:r:c:b:d:a:p:B:L:D:IC:TPW", long_options, NULL)) != -1 ) {  // for each option...
     switch ( opt ) {
     case 'f':
       write_to_file = true;
@@ -135,12 +161,109 @@ int main( int argc, char** argv ) {
       config.pathtracer_direct_hemisphere_sample = true;
       optind--;
       break;
+    case 'B':
+      if (string(optarg) == "median") {
+        config.pathtracer_bvh_build_method = SceneObjects::BVH_BUILD_MEDIAN;
+      } else if (string(optarg) == "sah") {
+        config.pathtracer_bvh_build_method = SceneObjects::BVH_BUILD_SAH;
+      } else if (string(optarg) == "lbvh") {
+        config.pathtracer_bvh_build_method = SceneObjects::BVH_BUILD_LBVH;
+      } else if (string(optarg) == "sbvh") {
+        config.pathtracer_bvh_build_method = SceneObjects::BVH_BUILD_SBVH;
+      } else {
+        msg("Unknown BVH build method: " << optarg);
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'L':
+      if (string(optarg) == "binary") {
+        config.pathtracer_bvh_layout = SceneObjects::BVH_LAYOUT_BINARY;
+      } else if (string(optarg) == "wide4") {
+        config.pathtracer_bvh_layout = SceneObjects::BVH_LAYOUT_WIDE4;
+      } else if (string(optarg) == "wide8") {
+        config.pathtracer_bvh_layout = SceneObjects::BVH_LAYOUT_WIDE8;
+      } else if (string(optarg) == "qwide4") {
+        config.pathtracer_bvh_layout = SceneObjects::BVH_LAYOUT_QWIDE4;
+      } else if (string(optarg) == "qwide8") {
+        config.pathtracer_bvh_layout = SceneObjects::BVH_LAYOUT_QWIDE8;
+      } else {
+        msg("Unknown BVH node layout: " << optarg);
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'D':
+      config.pathtracer_bvh_duplication_budget = atof(optarg);
+      break;
+    case 'I':
+      config.pathtracer_bvh_instancing = true;
+      break;
+    case 'C':
+      config.pathtracer_bvh_cache_dir = string(optarg);
+      break;
+    case 'T':
+      config.pathtracer_bvh_treelets = true;
+      break;
+    case 'P':
+      config.pathtracer_packet_tracing = true;
+      break;
+    case 'W':
+      config.pathtracer_stream_tracing = true;
+      break;
+    case OPT_BVH_STATS:
+      bvh_stats = true;
+      break;
+    case OPT_BENCH_SLABS:
+      bench_slabs = true;
+      break;
+    case OPT_PROGRESSIVE:
+    {
+      // samples are counted in ints by the path tracer
+      char *end;
+      errno = 0;
+      long pass_samples = strtol(optarg, &end, 10);
+      if (end == optarg || *end != '\0' || errno == ERANGE ||
+          pass_samples <= 0 || pass_samples > INT_MAX) {
+        msg("Invalid progressive pass size: " << optarg);
+        usage(argv[0]);
+        return 1;
+      }
+      config.pathtracer_pass_samples = pass_samples;
+      break;
+    }
+    case OPT_TIME_BUDGET:
+    {
+      char *end;
+      double budget = strtod(optarg, &end);
+      if (end == optarg || *end != '\0' || !(budget > 0)) {
+        msg("Invalid time budget: " << optarg);
+        usage(argv[0]);
+        return 1;
+      }
+      config.pathtracer_time_budget = budget;
+      break;
+    }
     default:
       usage(argv[0]);
       return 1;
     }
   }
 
+  // treelets group wide nodes, the binary layout has none to reorder
+  if (config.pathtracer_bvh_treelets &&
+      config.pathtracer_bvh_layout == SceneObjects::BVH_LAYOUT_BINARY) {
+    msg("Treelets (-T) need a wide BVH node layout (-L)");
+    usage(argv[0]);
+    return 1;
+  }
+
+  // the slab test benchmark needs no scene
+  if (bench_slabs) {
+    CGL::SceneObjects::benchmark_slab_tests(1 << 26);
+    return 0;
+  }
+
   // print usage if no argument given
   if (optind >= argc) {
     usage(argv[0]);
@@ -161,7 +284,16 @@ int main( int argc, char** argv ) {
   }
 
   // create application
-  Application *app  = new Application(config, !write_to_file);
+  Application *app  = new Application(config, !write_to_file && !bvh_stats);
+
+  // compare the BVH builders without rendering if --bvh-stats provided
+  if (bvh_stats) {
+    app->init();
+    app->load(sceneInfo);
+    delete sceneInfo;
+    app->report_bvh_stats();
+    return 0;
+  }
 
   msg("Rendering using " << config.pathtracer_num_threads << " threads");
 
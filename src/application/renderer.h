@@ -79,6 +79,12 @@ public:
 
     virtual void raytrace_cell(ImageBuffer& buffer) = 0;
 
+    /**
+     * Print build time, memory use and quality measures of the BVH builders
+     * on the given scene, without setting it.
+     */
+    virtual void report_bvh_stats(Scene* scene) = 0;
+
     /**
      * If the pathtracer is in VISUALIZE, handle key presses to traverse the bvh.
      */
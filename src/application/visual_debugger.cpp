@@ -161,17 +161,22 @@ namespace CGL
         DragDouble("Min T", &r.min_t, 0.005);
         DragDouble("Max T", &r.max_t, 0.005);
 
+        // the fields above are edited in place, so rebuild the ray to update
+        // its inverse direction and triangle test shear
+        Ray test(r.o, r.d, r.max_t);
+        test.min_t = r.min_t;
+
         if (ImGui::TreeNode("Triangle"))
         {
-          static SceneObjects::Triangle t;
+          static std::vector<Vector3D> p(3), n(3);
 
-          DragDouble3("P1", &t.p1[0], 0.005);
-          DragDouble3("P2", &t.p2[0], 0.005);
-          DragDouble3("P3", &t.p3[0], 0.005);
+          DragDouble3("P1", &p[0][0], 0.005);
+          DragDouble3("P2", &p[1][0], 0.005);
+          DragDouble3("P3", &p[2][0], 0.005);
 
-          DragDouble3("N1", &t.n1[0], 0.005);
-          DragDouble3("N2", &t.n2[0], 0.005);
-          DragDouble3("N3", &t.n3[0], 0.005);
+          DragDouble3("N1", &n[0][0], 0.005);
+          DragDouble3("N2", &n[1][0], 0.005);
+          DragDouble3("N3", &n[2][0], 0.005);
 
           static SceneObjects::Intersection isect;
 
@@ -179,7 +184,9 @@ namespace CGL
 
           if (ImGui::Button("Test Intersect"))
           {
-            success = t.intersect(r, &isect);
+            // triangles read their vertices from a mesh
+            SceneObjects::Mesh mesh(p, n, {0, 1, 2}, nullptr);
+            success = mesh.get_primitives()[0]->intersect(test, &isect);
           }
 
           if (success)
@@ -213,7 +220,7 @@ namespace CGL
 
           if (ImGui::Button("Test Intersect"))
           {
-            success = s.intersect(r, &isect);
+            success = s.intersect(test, &isect);
           }
 
           if (success)
@@ -9,6 +9,10 @@ using namespace CGL::SceneObjects;
 
 namespace CGL {
 
+// Largest number of secondary rays traced as one stream, which bounds the
+// memory of a wavefront.
+static const size_t STREAM_MAX_RAYS = 1 << 16;
+
 PathTracer::PathTracer() {
   gridSampler = new UniformGridSampler2D();
   hemisphereSampler = new UniformHemisphereSampler3D();
@@ -17,6 +21,10 @@ PathTracer::PathTracer() {
   tm_level = 1.0f;
   tm_key = 0.18;
   tm_wht = 5.0f;
+
+  packet_tracing = false;
+  stream_tracing = false;
+  ns_pass = 0;
 }
 
 PathTracer::~PathTracer() {
@@ -27,6 +35,7 @@ PathTracer::~PathTracer() {
 void PathTracer::set_frame_size(size_t width, size_t height) {
   sampleBuffer.resize(width, height);
   sampleCountBuffer.resize(width * height);
+  sampleMomentBuffer.resize(width * height);
 }
 
 void PathTracer::clear() {
@@ -35,6 +44,7 @@ void PathTracer::clear() {
   camera = NULL;
   sampleBuffer.clear();
   sampleCountBuffer.clear();
+  sampleMomentBuffer.clear();
   sampleBuffer.resize(0, 0);
   sampleCountBuffer.resize(0, 0);
 }
@@ -115,18 +125,33 @@ PathTracer::estimate_direct_lighting_importance(const Ray &r,
     double distance, pdf;
     int i = 0;
     while (i < n_s) {
-      Vector3D rad = lamp->sample_L(hit_p, &wi, &distance, &pdf), direction = w2o * wi;
-      if (direction.z >= 0) {
-        Vector3D o = (EPS_F * wi) + hit_p;
-        Ray owi = Ray(o, wi);
-        owi.min_t = EPS_F * 1.1;
-        owi.max_t = (distance - (EPS_F * 1.1));
-        Intersection isect_new;
-        if (!(bvh->intersect(owi, &isect_new))) {
-          L_samp += rad * isect.bsdf->f(w_out, direction) * cos_theta(direction) / pdf;
+      // shadow rays toward one light share their origin and are traced
+      // together when packet tracing is on. Only one_bounce_radiance with
+      // importance sampling gets here; est_radiance_global_illumination
+      // uses the hemisphere estimator for now, whose rays are incoherent
+      Ray shadow[BVH_PACKET_SIZE];
+      Vector3D contribution[BVH_PACKET_SIZE];
+      size_t n = 0, packet_size = packet_tracing ? BVH_PACKET_SIZE : 1;
+      for (; i < n_s && n < packet_size; i++) {
+        Vector3D rad = lamp->sample_L(hit_p, &wi, &distance, &pdf), direction = w2o * wi;
+        if (direction.z >= 0) {
+          Vector3D o = (EPS_F * wi) + hit_p;
+          Ray owi = Ray(o, wi);
+          owi.min_t = EPS_F * 1.1;
+          owi.max_t = (distance - (EPS_F * 1.1));
+          shadow[n] = owi;
+          contribution[n++] = rad * isect.bsdf->f(w_out, direction) * cos_theta(direction) / pdf;
         }
       }
-      i++;
+      uint32_t occluded = 0;
+      if (packet_tracing) {
+        occluded = bvh->has_intersection_packet(shadow, n);
+      } else if (n && bvh->has_intersection(shadow[0])) {
+        occluded = 1;
+      }
+      for (size_t k = 0; k < n; k++) {
+        if (!((occluded >> k) & 1)) L_samp += contribution[k];
+      }
     }
     // Normalize
     if (!lamp->is_delta_light()) {
@@ -174,6 +199,13 @@ Vector3D PathTracer::at_least_one_bounce_radiance(const Ray &r,
 
 Vector3D PathTracer::est_radiance_global_illumination(const Ray &r) {
   Intersection isect;
+  if (!bvh->intersect(r, &isect))
+    return est_radiance_global_illumination(r, NULL);
+  return est_radiance_global_illumination(r, &isect);
+}
+
+Vector3D PathTracer::est_radiance_global_illumination(const Ray &r,
+                                                      const Intersection *hit) {
   Vector3D L_out;
 
   // You will extend this in assignment 3-2.
@@ -186,8 +218,9 @@ Vector3D PathTracer::est_radiance_global_illumination(const Ray &r) {
   //
   // REMOVE THIS LINE when you are ready to begin Part 3.
   
-  if (!bvh->intersect(r, &isect))
+  if (!hit)
     return envLight ? envLight->sample_dir(r) : L_out;
+  const Intersection &isect = *hit;
 
   L_out = (isect.t == INF_D) ? debug_shading(r.d) : normal_shading(isect.n);
 
@@ -222,9 +255,15 @@ void PathTracer::raytrace_pixel(size_t x, size_t y) {
   // sampleCountBuffer[x + y * sampleBuffer.w] = num_samples;
 
   double w = this->sampleBuffer.w, h = this->sampleBuffer.h;
-  double sig = 0, sig_2 = 0;
-  int samp = 0;
-  Vector3D fin = Vector3D();
+
+  // resume from the samples of the previous passes, whose mean is in the
+  // sample buffer
+  size_t index = x + y * sampleBuffer.w;
+  int samp = sampleCountBuffer[index];
+  double sig = sampleMomentBuffer[index].x, sig_2 = sampleMomentBuffer[index].y;
+  Vector3D fin = sampleBuffer.data[index] * (double)samp;
+  int end = ns_pass ? std::min<int>(num_samples, samp + ns_pass) : num_samples;
+  if (samp >= end) return;
 
   if (num_samples == 1) {
     Ray ray = this->camera->generate_ray((x + 0.5) / w, (y + 0.5) / h);
@@ -233,8 +272,7 @@ void PathTracer::raytrace_pixel(size_t x, size_t y) {
     samp += 1;
   }
   else {
-    int samp;
-    for (samp = 0; samp < num_samples; samp++) {
+    while (samp < end) {
       //&& samp in following if statement?
       if (samp % samplesPerBatch == 0 && samp > 0) {
          //double mean = sig / double(i), var = (sig_2 - (sig * sig) / double(i)) / (i - 1.0);
@@ -242,18 +280,204 @@ void PathTracer::raytrace_pixel(size_t x, size_t y) {
            break;
          }
       }
-      Vector2D s_v = this->gridSampler->get_sample();
-      Ray s_r = this->camera->generate_ray((x + s_v.x) / w, (y + s_v.y) / h);
-      s_r.depth = this->max_ray_depth;
-      Vector3D curr = this->est_radiance_global_illumination(s_r);
-      fin += curr;
-      sig += curr.illum();
-      sig_2 += (curr.illum() * curr.illum());
+
+      // with packet tracing, the samples up to the next convergence check
+      // are traced together
+      int n = 1;
+      if (packet_tracing) {
+        n = std::min<int>(BVH_PACKET_SIZE, samplesPerBatch - samp % samplesPerBatch);
+        n = std::min(n, end - samp);
+      }
+      Ray s_r[BVH_PACKET_SIZE];
+      Vector3D curr[BVH_PACKET_SIZE];
+      for (int k = 0; k < n; k++) {
+        Vector2D s_v = this->gridSampler->get_sample();
+        s_r[k] = this->camera->generate_ray((x + s_v.x) / w, (y + s_v.y) / h);
+        s_r[k].depth = this->max_ray_depth;
+      }
+      if (packet_tracing) {
+        trace_camera_packet(s_r, curr, n);
+      } else {
+        curr[0] = this->est_radiance_global_illumination(s_r[0]);
+      }
+      for (int k = 0; k < n; k++) {
+        fin += curr[k];
+        sig += curr[k].illum();
+        sig_2 += (curr[k].illum() * curr[k].illum());
+      }
+      samp += n;
     }
   }
   fin = fin / (double) samp;
   sampleBuffer.update_pixel(fin, x, y);
-  sampleCountBuffer[x + y * w] = samp;
+  sampleCountBuffer[index] = samp;
+  sampleMomentBuffer[index] = Vector2D(sig, sig_2);
+}
+
+void PathTracer::raytrace_block(size_t x0, size_t y0, size_t x1, size_t y1) {
+  // with several samples per pixel, the samples of a pixel form the packets
+  if (ns_aa != 1) {
+    for (size_t y = y0; y < y1; y++) {
+      for (size_t x = x0; x < x1; x++) raytrace_pixel(x, y);
+    }
+    return;
+  }
+
+  double w = this->sampleBuffer.w, h = this->sampleBuffer.h;
+  Ray rays[BVH_PACKET_SIZE];
+  Vector3D radiance[BVH_PACKET_SIZE];
+  size_t n = 0;
+  for (size_t y = y0; y < y1; y++) {
+    for (size_t x = x0; x < x1; x++) {
+      rays[n] = this->camera->generate_ray((x + 0.5) / w, (y + 0.5) / h);
+      rays[n++].depth = this->max_ray_depth;
+    }
+  }
+  trace_camera_packet(rays, radiance, n);
+
+  n = 0;
+  for (size_t y = y0; y < y1; y++) {
+    for (size_t x = x0; x < x1; x++) {
+      sampleBuffer.update_pixel(radiance[n++], x, y);
+      sampleCountBuffer[x + y * w] = 1;
+    }
+  }
+}
+
+void PathTracer::trace_camera_packet(const Ray *rays, Vector3D *radiance, size_t n) {
+  Intersection isects[BVH_PACKET_SIZE];
+  uint32_t hits = bvh->intersect_packet(rays, isects, n);
+  for (size_t k = 0; k < n; k++) {
+    radiance[k] = est_radiance_global_illumination(rays[k], ((hits >> k) & 1) ? &isects[k] : NULL);
+  }
+}
+
+void PathTracer::raytrace_tile_stream(size_t x0, size_t y0, size_t x1, size_t y1) {
+  size_t tile_w = x1 - x0, num_pixels = (x1 - x0) * (y1 - y0);
+  double w = this->sampleBuffer.w, h = this->sampleBuffer.h;
+
+  vector<Vector3D> fin(num_pixels);
+  vector<double> sig(num_pixels, 0), sig_2(num_pixels, 0);
+  vector<int> samp(num_pixels, 0), end(num_pixels);
+  vector<uint8_t> active(num_pixels, 1);
+  int num_samples = ns_aa;
+  int batch = num_samples == 1 ? 1 : (int)samplesPerBatch;
+
+  // same convergence test as raytrace_pixel, done after whole batches only
+  auto converged = [&](size_t p) {
+    double n = samp[p];
+    if (samp[p] % batch != 0) return false;
+    return 1.96 * sqrt((sig_2[p] - (sig[p] * sig[p]) / n) / (n - 1.0) / n) <= maxTolerance * sig[p] / n;
+  };
+
+  // resume from the samples of the previous passes
+  for (size_t p = 0; p < num_pixels; p++) {
+    size_t index = x0 + p % tile_w + (y0 + p / tile_w) * sampleBuffer.w;
+    samp[p] = sampleCountBuffer[index];
+    sig[p] = sampleMomentBuffer[index].x;
+    sig_2[p] = sampleMomentBuffer[index].y;
+    fin[p] = sampleBuffer.data[index] * (double)samp[p];
+    end[p] = ns_pass ? std::min<int>(num_samples, samp[p] + ns_pass) : num_samples;
+    if (samp[p] >= end[p] || (samp[p] > 0 && converged(p))) active[p] = 0;
+  }
+
+  // every round traces one batch of samples of all unconverged pixels,
+  // one bounce after the other
+  vector<Ray> rays;
+  vector<Intersection> isects;
+  vector<uint8_t> hits;
+  vector<Vector3D> radiance;
+  vector<uint32_t> pixel;
+  while (true) {
+    rays.clear();
+    pixel.clear();
+    for (size_t p = 0; p < num_pixels; p++) {
+      if (!active[p]) continue;
+      size_t x = x0 + p % tile_w, y = y0 + p / tile_w;
+      int n = std::min(batch - samp[p] % batch, end[p] - samp[p]);
+      for (int k = 0; k < n; k++) {
+        Vector2D s_v = num_samples == 1 ? Vector2D(0.5, 0.5) : this->gridSampler->get_sample();
+        rays.push_back(this->camera->generate_ray((x + s_v.x) / w, (y + s_v.y) / h));
+        rays.back().depth = this->max_ray_depth;
+        pixel.push_back((uint32_t)p);
+      }
+    }
+    if (rays.empty()) break;
+
+    isects.assign(rays.size(), Intersection());
+    hits.resize(rays.size());
+    bvh->intersect_stream(rays.data(), isects.data(), hits.data(), rays.size());
+    radiance.assign(rays.size(), Vector3D());
+    shade_stream(rays, isects, hits, radiance);
+
+    for (size_t i = 0; i < rays.size(); i++) {
+      uint32_t p = pixel[i];
+      fin[p] += radiance[i];
+      sig[p] += radiance[i].illum();
+      sig_2[p] += radiance[i].illum() * radiance[i].illum();
+      samp[p]++;
+    }
+
+    for (size_t p = 0; p < num_pixels; p++) {
+      if (active[p] && (samp[p] >= end[p] || converged(p))) active[p] = 0;
+    }
+  }
+
+  for (size_t p = 0; p < num_pixels; p++) {
+    size_t x = x0 + p % tile_w, y = y0 + p / tile_w;
+    if (samp[p] == 0) continue;
+    sampleBuffer.update_pixel(fin[p] / (double)samp[p], x, y);
+    sampleCountBuffer[x + y * w] = samp[p];
+    sampleMomentBuffer[x + y * w] = Vector2D(sig[p], sig_2[p]);
+  }
+}
+
+void PathTracer::shade_stream(const vector<Ray> &rays, const vector<Intersection> &isects,
+                              const vector<uint8_t> &hits, vector<Vector3D> &radiance) {
+  vector<Ray> bounce;
+  vector<Intersection> bounce_isects;
+  vector<uint8_t> bounce_hits;
+  vector<uint32_t> source;
+  vector<Vector3D> weight;
+  auto trace_bounce = [&]() {
+    bounce_isects.assign(bounce.size(), Intersection());
+    bounce_hits.resize(bounce.size());
+    bvh->intersect_stream(bounce.data(), bounce_isects.data(), bounce_hits.data(), bounce.size());
+    for (size_t i = 0; i < bounce.size(); i++) {
+      if (bounce_hits[i]) radiance[source[i]] += bounce_isects[i].bsdf->get_emission() * weight[i];
+    }
+    bounce.clear();
+    source.clear();
+    weight.clear();
+  };
+
+  int num_samples = scene->lights.size() * ns_area_light;
+  float p = 1 / (2 * PI);
+  for (size_t i = 0; i < rays.size(); i++) {
+    const Ray &r = rays[i];
+    if (!hits[i]) {
+      radiance[i] = envLight ? envLight->sample_dir(r) : Vector3D();
+      continue;
+    }
+    const Intersection &isect = isects[i];
+    radiance[i] = at_least_one_bounce_radiance(r, isect);
+
+    // the hemisphere samples of estimate_direct_lighting_hemisphere, traced
+    // as one stream for all the hits
+    Matrix3x3 o2w;
+    make_coord_space(o2w, isect.n);
+    Matrix3x3 w2o = o2w.T();
+    const Vector3D hit_p = r.o + r.d * isect.t;
+    const Vector3D w_out = w2o * (-r.d);
+    for (int s = 0; s < num_samples; s++) {
+      Vector3D w = hemisphereSampler->get_sample(), d = o2w * w, o = (EPS_F * d) + hit_p;
+      bounce.push_back(Ray(o, d));
+      source.push_back((uint32_t)i);
+      weight.push_back(isect.bsdf->f(w_out, w) * w.z / p / num_samples);
+    }
+    if (bounce.size() >= STREAM_MAX_RAYS) trace_bounce();
+  }
+  if (!bounce.empty()) trace_bounce();
 }
 
 void PathTracer::autofocus(Vector2D loc) {
@@ -51,6 +51,12 @@ namespace CGL {
         Vector3D estimate_direct_lighting_importance(const Ray& r, const SceneObjects::Intersection& isect);
 
         Vector3D est_radiance_global_illumination(const Ray& r);
+
+        /**
+         * Radiance along a ray that was already intersected with the scene.
+         * \param hit intersection of the ray, or NULL if it missed
+         */
+        Vector3D est_radiance_global_illumination(const Ray& r, const SceneObjects::Intersection* hit);
         Vector3D zero_bounce_radiance(const Ray& r, const SceneObjects::Intersection& isect);
         Vector3D one_bounce_radiance(const Ray& r, const SceneObjects::Intersection& isect);
         Vector3D at_least_one_bounce_radiance(const Ray& r, const SceneObjects::Intersection& isect);
@@ -64,10 +70,42 @@ namespace CGL {
         }
 
         /**
-         * Trace a camera ray given by the pixel coordinate.
+         * Trace a camera ray given by the pixel coordinate. The samples are
+         * added to the ones the pixel already has, so in progressive mode
+         * every call traces at most ns_pass more of them.
          */
         void raytrace_pixel(size_t x, size_t y);
 
+        /**
+         * Trace the pixels [x0, x1) x [y0, y1), at most BVH_PACKET_WIDTH on a
+         * side, with their camera rays in one packet.
+         */
+        void raytrace_block(size_t x0, size_t y0, size_t x1, size_t y1);
+
+        /**
+         * Intersect up to BVH_PACKET_SIZE camera rays as a packet and
+         * estimate the radiance along each of them.
+         */
+        void trace_camera_packet(const Ray* rays, Vector3D* radiance, size_t n);
+
+        /**
+         * Trace the pixels [x0, x1) x [y0, y1) as a wavefront: each round
+         * generates one batch of camera rays for every pixel that has not
+         * converged yet, and every bounce of the whole batch is intersected
+         * as one ray stream.
+         */
+        void raytrace_tile_stream(size_t x0, size_t y0, size_t x1, size_t y1);
+
+        /**
+         * Estimate the radiance along a stream of intersected rays, as
+         * est_radiance_global_illumination does for one ray, tracing the
+         * secondary rays of all of them as streams.
+         */
+        void shade_stream(const std::vector<Ray>& rays,
+                          const std::vector<SceneObjects::Intersection>& isects,
+                          const std::vector<uint8_t>& hits,
+                          std::vector<Vector3D>& radiance);
+
         // Integrator sampling settings //
 
         size_t max_ray_depth; ///< maximum allowed ray depth (applies to all rays)
@@ -77,9 +115,13 @@ namespace CGL {
         size_t ns_glsy;       ///< number of samples - glossy surfaces
         size_t ns_refr;       ///< number of samples - refractive surfaces
 
+        size_t ns_pass;       ///< most camera rays added to a pixel by one progressive pass, 0 to trace them all at once
+
         size_t samplesPerBatch;
         double maxTolerance;
         bool direct_hemisphere_sample; ///< true if sampling uniformly from hemisphere for direct lighting. Otherwise, light sample
+        bool packet_tracing;  ///< trace camera and shadow rays in packets
+        bool stream_tracing;  ///< trace tiles as wavefronts of ray streams
 
         // Components //
 
@@ -91,6 +133,7 @@ namespace CGL {
         Timer timer;                   ///< performance test timer
 
         std::vector<int> sampleCountBuffer;   ///< sample count buffer
+        std::vector<Vector2D> sampleMomentBuffer;  ///< sums of the illuminance of the samples and of its square, for adaptive sampling across passes
 
         Scene* scene;         ///< current scene
         Camera* camera;       ///< current camera
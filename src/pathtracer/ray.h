@@ -6,6 +6,8 @@
 #include "CGL/vector4D.h"
 #include "CGL/matrix4x4.h"
 
+#include <utility>
+
 #define PART 5
 
 #define PART_1 (PART >= 1)
@@ -26,6 +28,9 @@ struct Ray {
   mutable double max_t; ///< treat the ray as a segment (ray "ends" at max_t)
 
   Vector3D inv_d;  ///< component wise inverse
+  int sign[3];     ///< 1 if the direction is negative along the axis
+  int kx, ky, kz;  ///< axes of the watertight triangle test, kz is the dominant one
+  float shear[3];  ///< shear and scale that map the direction to the kz axis
 
   Ray() {}
 
@@ -39,6 +44,8 @@ struct Ray {
     Ray(const Vector3D o, const Vector3D d, int depth = 0)
         : o(o), d(d), min_t(0.0), max_t(INF_D), depth(depth) {
     inv_d = 1.0 / d;
+    set_sign();
+    set_shear();
   }
 
   /**
@@ -52,8 +59,36 @@ struct Ray {
     Ray(const Vector3D o, const Vector3D d, double max_t, int depth = 0)
         : o(o), d(d), min_t(0.0), max_t(max_t), depth(depth) {
     inv_d = 1.0 / d;
+    set_sign();
+    set_shear();
+  }
+
+  /**
+   * Precompute the direction signs used to pick the near and far slabs of
+   * bounding boxes. Uses inv_d so that -0 counts as negative.
+   */
+  inline void set_sign() {
+    sign[0] = inv_d.x < 0;
+    sign[1] = inv_d.y < 0;
+    sign[2] = inv_d.z < 0;
   }
 
+  /**
+   * Precompute the permutation and shear of the watertight ray - triangle
+   * test (Woop et al. 2013), which moves the ray origin to 0 and maps the
+   * direction to the unit kz axis. kx and ky are swapped for negative
+   * directions to keep the winding of the triangles.
+   */
+  inline void set_shear() {
+    kz = fabs(d.x) > fabs(d.y) ? (fabs(d.x) > fabs(d.z) ? 0 : 2)
+                               : (fabs(d.y) > fabs(d.z) ? 1 : 2);
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+    if (d[kz] < 0) std::swap(kx, ky);
+    shear[0] = (float)(d[kx] / d[kz]);
+    shear[1] = (float)(d[ky] / d[kz]);
+    shear[2] = (float)(1.0 / d[kz]);
+  }
 
   /**
    * Returns the point t * |d| along the ray.
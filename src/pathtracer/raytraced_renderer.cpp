@@ -6,6 +6,7 @@
 #include <random>
 #include <algorithm>
 #include <sstream>
+#include <unordered_map>
 
 #include "CGL/CGL.h"
 #include "CGL/vector3D.h"
@@ -17,6 +18,8 @@
 #include "scene/sphere.h"
 #include "scene/triangle.h"
 #include "scene/light.h"
+#include "scene/object.h"
+#include "scene/instance.h"
 
 using namespace CGL::SceneObjects;
 
@@ -25,6 +28,36 @@ using std::max;
 
 namespace CGL {
 
+// A refitted BVH is kept as long as its SAH cost stays below this multiple
+// of the cost it was built with.
+static const double BVH_REFIT_MAX_COST_RATIO = 1.5;
+
+// Interval at which a thread waiting for a render prints its progress.
+static const int PROGRESS_REPORT_MS = 100;
+
+// Camera rays per pixel per pass of a time budgeted render, unless set
+// with the pass size of the progressive mode.
+static const size_t TIME_BUDGET_PASS_SAMPLES = 4;
+
+// Hash of the scene connectivity: the kinds of the objects, in order, and
+// the triangles of every mesh. Scenes with the same hash have matching
+// primitives, so a BVH built for one can be refitted to the other. Instances
+// that released their geometry count as empty meshes.
+static uint64_t scene_topology(const Scene *scene) {
+  uint64_t hash = 14695981039346656037ull;
+  auto mix = [&hash](uint64_t value) { hash = (hash ^ value) * 1099511628211ull; };
+  for (SceneObject *obj : scene->objects) {
+    const SceneObjects::Mesh *mesh = dynamic_cast<const SceneObjects::Mesh *>(obj);
+    if (!mesh) {
+      mix(0);
+      continue;
+    }
+    mix(mesh->get_indices().size() + 1);
+    for (size_t index : mesh->get_indices()) mix(index);
+  }
+  return hash;
+}
+
 /**
  * Raytraced Renderer is a render controller that in this case.
  * It controls a path tracer to produce an rendered image from the input parameters.
@@ -47,7 +80,17 @@ RaytracedRenderer::RaytracedRenderer(size_t ns_aa,
                        bool direct_hemisphere_sample,
                        string filename,
                        double lensRadius,
-                       double focalDistance) {
+                       double focalDistance,
+                       BVHBuildMethod bvh_build_method,
+                       BVHLayout bvh_layout,
+                       double bvh_duplication_budget,
+                       bool bvh_instancing,
+                       string bvh_cache_dir,
+                       bool bvh_treelets,
+                       bool packet_tracing,
+                       bool stream_tracing,
+                       size_t pass_samples,
+                       double time_budget) {
   state = INIT;
 
   pt = new PathTracer();
@@ -61,10 +104,28 @@ RaytracedRenderer::RaytracedRenderer(size_t ns_aa,
   pt->samplesPerBatch = samples_per_batch;                  // Number of samples per batch
   pt->maxTolerance = max_tolerance;                         // Maximum tolerance for early termination
   pt->direct_hemisphere_sample = direct_hemisphere_sample;  // Whether to use direct hemisphere sampling vs. Importance Sampling
+  pt->packet_tracing = packet_tracing;                      // Whether to trace camera and shadow rays in packets
+  pt->stream_tracing = stream_tracing;                      // Whether to trace tiles as wavefronts of ray streams
+  pt->ns_pass = pass_samples;                               // Number of samples per pixel per progressive pass
+
+  // a time budget needs passes to stop between
+  this->timeBudget = time_budget;
+  if (time_budget > 0 && !pass_samples) {
+    pt->ns_pass = TIME_BUDGET_PASS_SAMPLES;
+  }
 
   this->lensRadius = lensRadius;
   this->focalDistance = focalDistance;
 
+  this->bvhBuildMethod = bvh_build_method;
+  this->bvhLayout = bvh_layout;
+  this->bvhDuplicationBudget = bvh_duplication_budget;
+  this->bvhInstancing = bvh_instancing;
+  this->bvhCacheDir = bvh_cache_dir;
+  this->bvhTreelets = bvh_treelets;
+  this->bvhTopology = 0;
+  this->bvhBuildCost = 0;
+
   this->filename = filename;
 
   if (envmap) {
@@ -81,7 +142,15 @@ RaytracedRenderer::RaytracedRenderer(size_t ns_aa,
 
   imageTileSize = 32;                     // Size of the rendering tile.
   numWorkerThreads = num_threads;         // Number of threads
+
+  // the workers are started once and wait for renders to join
+  jobGeneration = 0;
+  workersBusy = 0;
+  shutdownWorkers = false;
   workerThreads.resize(numWorkerThreads);
+  for (size_t i = 0; i < numWorkerThreads; i++) {
+    workerThreads[i] = new std::thread(&RaytracedRenderer::worker_thread, this, i);
+  }
 }
 
 /**
@@ -90,7 +159,18 @@ RaytracedRenderer::RaytracedRenderer(size_t ns_aa,
  */
 RaytracedRenderer::~RaytracedRenderer() {
 
-  delete bvh;
+  stop();
+  {
+    lock_guard<std::mutex> lk(m_workers);
+    shutdownWorkers = true;
+  }
+  cv_job.notify_all();
+  for (std::thread *worker : workerThreads) {
+    worker->join();
+    delete worker;
+  }
+
+  delete_accel();
   delete pt;
 
 }
@@ -110,7 +190,7 @@ void RaytracedRenderer::set_scene(Scene *scene) {
 
   if (this->scene != nullptr) {
     delete scene;
-    delete bvh;
+    delete_accel();
     selectionHistory.pop();
   }
 
@@ -198,6 +278,7 @@ void RaytracedRenderer::update_screen() {
                    GL_UNSIGNED_BYTE, &frameBuffer.data[0]);
       if (render_cell)
         visualize_cell();
+      report_progress();
       break;
     case DONE:
       glDrawPixels(frameBuffer.w, frameBuffer.h, GL_RGBA,
@@ -225,10 +306,7 @@ void RaytracedRenderer::stop() {
     case RENDERING:
       continueRaytracing = false;
     case DONE:
-      for (int i=0; i<numWorkerThreads; i++) {
-            workerThreads[i]->join();
-            delete workerThreads[i];
-        }
+      wait_for_workers();
       state = READY;
       break;
   }
@@ -239,8 +317,9 @@ void RaytracedRenderer::stop() {
  */
 void RaytracedRenderer::clear() {
   if (state != READY) return;
-  delete bvh;
-  bvh = NULL;
+  // the BVH is kept so that it can be refitted if the scene comes back
+  // with the same topology, and the instance BVHs so that the geometry
+  // still in the scene is not built again
   scene = NULL;
   camera = NULL;
   selectionHistory.pop();
@@ -268,7 +347,6 @@ void RaytracedRenderer::start_raytracing() {
   if (state != READY) return;
 
   rayLog.clear();
-  workQueue.clear();
 
   state = RENDERING;
   continueRaytracing = true;
@@ -284,19 +362,18 @@ void RaytracedRenderer::start_raytracing() {
   pt->camera = camera;
   pt->scene = scene;
 
+  tiles.clear();
   if (!render_cell) {
     frameBuffer.clear();
     num_tiles_w = width / imageTileSize + 1;
     num_tiles_h = height / imageTileSize + 1;
-    tilesTotal = num_tiles_w * num_tiles_h;
-    tilesDone = 0;
     tile_samples.resize(num_tiles_w * num_tiles_h);
     memset(&tile_samples[0], 0, num_tiles_w * num_tiles_h * sizeof(int));
 
     // populate the tile work queue
     for (size_t y = 0; y < height; y += imageTileSize) {
         for (size_t x = 0; x < width; x += imageTileSize) {
-            workQueue.put_work(WorkItem(x, y, imageTileSize, imageTileSize));
+            tiles.push_back(WorkItem(x, y, imageTileSize, imageTileSize));
         }
     }
   } else {
@@ -305,35 +382,63 @@ void RaytracedRenderer::start_raytracing() {
     int imTS = imageTileSize / 4;
     num_tiles_w = w / imTS + 1;
     num_tiles_h = h / imTS + 1;
-    tilesTotal = num_tiles_w * num_tiles_h;
-    tilesDone = 0;
     tile_samples.resize(num_tiles_w * num_tiles_h);
     memset(&tile_samples[0], 0, num_tiles_w * num_tiles_h * sizeof(int));
 
     // populate the tile work queue
     for (size_t y = cell_tl.y; y < cell_br.y; y += imTS) {
       for (size_t x = cell_tl.x; x < cell_br.x; x += imTS) {
-        workQueue.put_work(WorkItem(x, y, 
+        tiles.push_back(WorkItem(x, y, 
           min(imTS, (int)(cell_br.x-x)), min(imTS, (int)(cell_br.y-y)) ));
       }
     }
   }
+  // in progressive mode every pass adds up to ns_pass samples to each pixel
+  numPasses = pt->ns_pass ? (pt->ns_aa + pt->ns_pass - 1) / pt->ns_pass : 1;
+  passesDone = 0;
+  passStartTime = 0;
+  tilesTotal = tiles.size() * numPasses;
+  tilesDone = 0;
+  progressReported = -1;
 
   bvh->total_isects = 0; bvh->total_rays = 0;
-  // launch threads
   fprintf(stdout, "[PathTracer] Rendering... "); fflush(stdout);
-  for (int i=0; i<numWorkerThreads; i++) {
-      workerThreads[i] = new std::thread(&RaytracedRenderer::worker_thread, this);
+  renderTimer.start();
+  progressTimer.start();
+  start_pass();
+}
+
+void RaytracedRenderer::start_pass() {
+  // the tiles are in scanline order, so every worker starts on a band of
+  // neighbouring tiles
+  workQueue.assign(tiles, numWorkerThreads);
+  workerDoneCount = 0;
+
+  // wake up the workers
+  {
+    lock_guard<std::mutex> lk(m_workers);
+    jobGeneration++;
+    workersBusy += numWorkerThreads;
   }
+  cv_job.notify_all();
 }
 
 void RaytracedRenderer::render_to_file(string filename, size_t x, size_t y, size_t dx, size_t dy) {
   if (x == -1) {
     unique_lock<std::mutex> lk(m_done);
     start_raytracing();
-    cv_done.wait(lk, [this]{ return state == DONE; });
+    while (!cv_done.wait_for(lk, std::chrono::milliseconds(PROGRESS_REPORT_MS),
+                             [this]{ return state == DONE; })) {
+      report_progress();
+    }
     lk.unlock();
     save_image(filename);
+    if (pt->ns_pass) {
+      double samples = 0;
+      for (int n : pt->sampleCountBuffer) samples += n;
+      fprintf(stdout, "[PathTracer] Achieved %.2f samples per pixel in %zu passes.\n",
+              samples / max<size_t>(1, pt->sampleCountBuffer.size()), (size_t)passesDone);
+    }
     fprintf(stdout, "[PathTracer] Job completed.\n");
   } else {
     render_cell = true;
@@ -353,26 +458,232 @@ void RaytracedRenderer::build_accel() {
   fprintf(stdout, "[PathTracer] Collecting primitives... "); fflush(stdout);
   timer.start();
   vector<Primitive *> primitives;
-  for (SceneObject *obj : scene->objects) {
-    const vector<Primitive *> &obj_prims = obj->get_primitives();
-    primitives.reserve(primitives.size() + obj_prims.size());
-    primitives.insert(primitives.end(), obj_prims.begin(), obj_prims.end());
+  if (bvhInstancing) {
+    build_instances(primitives);
+  } else {
+    for (SceneObject *obj : scene->objects) {
+      const vector<Primitive *> &obj_prims = obj->get_primitives();
+      primitives.reserve(primitives.size() + obj_prims.size());
+      primitives.insert(primitives.end(), obj_prims.begin(), obj_prims.end());
+    }
   }
   timer.stop();
   fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
 
+  // refit the previous BVH if only the geometry moved //
+  uint64_t topology = scene_topology(scene);
+  if (bvh) {
+    if (topology == bvhTopology) {
+      fprintf(stdout, "[PathTracer] Refitting BVH... "); fflush(stdout);
+      timer.start();
+      double cost = bvh->refit(&primitives);
+      timer.stop();
+      if (cost <= bvhBuildCost * BVH_REFIT_MAX_COST_RATIO) {
+        fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
+        selectionHistory.push(bvh->get_root());
+        return;
+      }
+      fprintf(stdout, "SAH cost went from %.2f to %.2f, rebuilding.\n",
+              bvhBuildCost, cost);
+    }
+    // only the top level, the instance BVHs were just reused or built
+    delete bvh;
+    bvh = NULL;
+  }
+
+  // load BVH from the cache //
+  // spatial splits depend on the primitives themselves, not only on the
+  // bounds hashed into the key, so SBVHs are always built
+  string cache_path;
+  uint64_t cache_key = 0;
+  if (!bvhCacheDir.empty() && !bvhInstancing &&
+      bvhBuildMethod != CGL::SceneObjects::BVH_BUILD_SBVH) {
+    cache_key = BVHAccel::cache_key(primitives, 4, bvhBuildMethod,
+                                    bvhDuplicationBudget);
+    char name[32];
+    snprintf(name, sizeof(name), "bvh_%016llx.cache", (unsigned long long)cache_key);
+    cache_path = bvhCacheDir + "/" + name;
+
+    timer.start();
+    bvh = BVHAccel::load(cache_path, cache_key, primitives, bvhLayout,
+                         bvhTreelets);
+    timer.stop();
+    if (bvh) {
+      fprintf(stdout, "[PathTracer] Loaded BVH from %s (%.4f sec)\n",
+              cache_path.c_str(), timer.duration());
+      bvhTopology = topology;
+      bvhBuildCost = bvh->get_sah_cost();
+      selectionHistory.push(bvh->get_root());
+      return;
+    }
+  }
+
   // build BVH //
-  fprintf(stdout, "[PathTracer] Building BVH from %lu primitives... ", primitives.size()); 
+  fprintf(stdout, "[PathTracer] Building BVH (%s, %s) from %lu primitives... ",
+          bvh_build_method_name(bvhBuildMethod), bvh_layout_name(bvhLayout),
+          primitives.size());
   fflush(stdout);
   timer.start();
-  bvh = new BVHAccel(primitives);
+  bvh = new BVHAccel(primitives, 4, bvhBuildMethod, numWorkerThreads, bvhLayout,
+                     bvhDuplicationBudget, bvhTreelets);
   timer.stop();
   fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
+  if (!cache_path.empty() && !bvh->save(cache_path, cache_key)) {
+    fprintf(stderr, "[PathTracer] Could not write BVH cache %s\n",
+            cache_path.c_str());
+  }
+  bvhTopology = topology;
+  bvhBuildCost = bvh->get_sah_cost();
+  if (bvhBuildMethod == CGL::SceneObjects::BVH_BUILD_SBVH) {
+    fprintf(stdout, "[PathTracer] BVH reference duplication factor %.4f\n",
+            bvh->get_duplication_factor());
+  }
+  fprintf(stdout, "[PathTracer] BVH uses %.2f MB, %.1f bytes per primitive, "
+          "of which nodes %.2f MB (%s)\n", bvh->get_memory() / (1024.0 * 1024.0),
+          (double)bvh->get_memory() / max<size_t>(1, primitives.size()),
+          bvh->get_node_memory() / (1024.0 * 1024.0), bvh_layout_name(bvhLayout));
 
   // initial visualization //
   selectionHistory.push(bvh->get_root());
 }
 
+void RaytracedRenderer::report_bvh_stats(Scene *scene) {
+  if (!scene) return;
+
+  vector<Primitive *> primitives;
+  for (SceneObject *obj : scene->objects) {
+    const vector<Primitive *> &obj_prims = obj->get_primitives();
+    primitives.insert(primitives.end(), obj_prims.begin(), obj_prims.end());
+  }
+
+  static const BVHBuildMethod methods[] = {
+    CGL::SceneObjects::BVH_BUILD_MEDIAN, CGL::SceneObjects::BVH_BUILD_SAH,
+    CGL::SceneObjects::BVH_BUILD_LBVH, CGL::SceneObjects::BVH_BUILD_SBVH
+  };
+  static const size_t leaf_sizes[] = { 1, 2, 4, 8, 16 };
+
+  fprintf(stdout, "[PathTracer] BVH statistics for %lu primitives, %s layout\n",
+          primitives.size(), bvh_layout_name(bvhLayout));
+  fprintf(stdout, "%-6s %4s %10s %9s %9s %5s %9s %9s %10s\n", "method", "leaf",
+          "build ms", "nodes", "leaves", "depth", "SAH cost", "overlap", "memory KB");
+  for (BVHBuildMethod method : methods) {
+    for (size_t leaf_size : leaf_sizes) {
+      Timer build_timer;
+      build_timer.start();
+      BVHAccel *stats_bvh = new BVHAccel(primitives, leaf_size, method,
+                                         numWorkerThreads, bvhLayout,
+                                         bvhDuplicationBudget, bvhTreelets);
+      build_timer.stop();
+      BVHStats stats = stats_bvh->get_stats();
+      delete stats_bvh;
+
+      fprintf(stdout, "%-6s %4lu %10.2f %9lu %9lu %5lu %9.3f %9.3f %10.1f\n",
+              bvh_build_method_name(method), leaf_size,
+              build_timer.duration() * 1000, stats.num_nodes, stats.num_leaves,
+              stats.max_depth, stats.sah_cost, stats.overlap,
+              stats.memory / 1024.0);
+      fprintf(stdout, "       leaf depths:");
+      for (size_t d = 0; d < stats.leaf_depths.size(); d++) {
+        if (stats.leaf_depths[d]) fprintf(stdout, " %lu:%lu", d, stats.leaf_depths[d]);
+      }
+      fprintf(stdout, "\n       leaf sizes: ");
+      for (size_t s = 0; s < stats.leaf_sizes.size(); s++) {
+        if (stats.leaf_sizes[s]) fprintf(stdout, " %lu:%lu", s, stats.leaf_sizes[s]);
+      }
+      fprintf(stdout, "\n");
+    }
+  }
+}
+
+void RaytracedRenderer::build_instances(vector<Primitive *> &primitives) {
+  // the instances of the previous scene are only referenced by the
+  // top-level BVH, which is refitted over the new ones or rebuilt
+  for (BVHInstance *instance : instances) {
+    delete instance;
+  }
+  instances.clear();
+
+  // meshes of the same geometry share one BVH, kept across scenes along
+  // with the geometry it was built over
+  std::unordered_map<std::string, vector<size_t> > by_geometry;
+  for (size_t k = 0; k < instanceGeometry.size(); k++) {
+    by_geometry[instanceGeometry[k]->geometry_id].push_back(k);
+  }
+  vector<bool> used(instanceBVHs.size(), false);
+  size_t num_built = 0;
+  for (SceneObject *obj : scene->objects) {
+    SceneObjects::Mesh *mesh = dynamic_cast<SceneObjects::Mesh *>(obj);
+    if (!mesh) {
+      const vector<Primitive *> &obj_prims = obj->get_primitives();
+      primitives.insert(primitives.end(), obj_prims.begin(), obj_prims.end());
+      continue;
+    }
+
+    mesh->to_object_space();
+    BVHAccel *shared = NULL;
+    vector<size_t> &candidates = by_geometry[mesh->geometry_id];
+    for (size_t k : candidates) {
+      if (instanceGeometry[k]->same_geometry(*mesh)) {
+        shared = instanceBVHs[k];
+        used[k] = true;
+        break;
+      }
+    }
+    // the shared BVHs own their geometry, so that the memory does not grow
+    // with the number of instances and the BVHs outlive the scene
+    if (shared) {
+      mesh->release_geometry();
+    } else {
+      SceneObjects::Mesh *geometry = mesh->detach_geometry();
+      shared = new BVHAccel(geometry->get_primitives(), 4, bvhBuildMethod,
+                            numWorkerThreads, bvhLayout, bvhDuplicationBudget,
+                            bvhTreelets);
+      candidates.push_back(instanceBVHs.size());
+      instanceBVHs.push_back(shared);
+      instanceGeometry.push_back(geometry);
+      used.push_back(true);
+      num_built++;
+    }
+    instances.push_back(new BVHInstance(shared, mesh->transform, mesh->get_bsdf()));
+    primitives.push_back(instances.back());
+  }
+
+  // drop the BVHs of the geometry that left the scene
+  size_t num_kept = 0;
+  for (size_t k = 0; k < instanceBVHs.size(); k++) {
+    if (!used[k]) {
+      delete instanceBVHs[k];
+      delete instanceGeometry[k];
+      continue;
+    }
+    instanceBVHs[num_kept] = instanceBVHs[k];
+    instanceGeometry[num_kept] = instanceGeometry[k];
+    num_kept++;
+  }
+  instanceBVHs.resize(num_kept);
+  instanceGeometry.resize(num_kept);
+
+  fprintf(stdout, "%lu instances of %lu meshes, %lu built... ", instances.size(),
+          instanceBVHs.size(), num_built);
+}
+
+void RaytracedRenderer::delete_accel() {
+  delete bvh;
+  bvh = NULL;
+  for (BVHInstance *instance : instances) {
+    delete instance;
+  }
+  instances.clear();
+  for (BVHAccel *instance_bvh : instanceBVHs) {
+    delete instance_bvh;
+  }
+  instanceBVHs.clear();
+  for (SceneObjects::Mesh *geometry : instanceGeometry) {
+    delete geometry;
+  }
+  instanceGeometry.clear();
+}
+
 void RaytracedRenderer::visualize_accel() const {
 
   glPushAttrib(GL_ENABLE_BIT);
@@ -389,17 +700,18 @@ void RaytracedRenderer::visualize_accel() const {
   Color cprim_hl_right = Color(.8, .8, 1.); float cprim_hl_right_alpha = 1.f;
   Color cprim_hl_edges = Color(0., 0., 0.); float cprim_hl_edges_alpha = 0.5f;
 
-  BVHNode *selected = selectionHistory.top();
+  size_t selected = selectionHistory.top();
+  const LinearBVHNode &selected_node = bvh->get_node(selected);
 
   // render solid geometry (with depth offset)
   glPolygonOffset(1.0, 1.0);
   glEnable(GL_POLYGON_OFFSET_FILL);
 
-  if (selected->isLeaf()) {
+  if (selected_node.isLeaf()) {
     bvh->draw(selected, cprim_hl_left, cprim_hl_left_alpha);
   } else {
-    bvh->draw(selected->l, cprim_hl_left, cprim_hl_left_alpha);
-    bvh->draw(selected->r, cprim_hl_right, cprim_hl_right_alpha);
+    bvh->draw(bvh->left_child(selected), cprim_hl_left, cprim_hl_left_alpha);
+    bvh->draw(bvh->right_child(selected), cprim_hl_right, cprim_hl_right_alpha);
   }
 
   glDisable(GL_POLYGON_OFFSET_FILL);
@@ -412,7 +724,7 @@ void RaytracedRenderer::visualize_accel() const {
   glDepthMask(GL_FALSE);
 
   // create traversal stack
-  stack<BVHNode *> tstack;
+  stack<size_t> tstack;
 
   // push initial traversal data
   tstack.push(bvh->get_root());
@@ -420,20 +732,25 @@ void RaytracedRenderer::visualize_accel() const {
   // draw all BVH bboxes with non-highlighted color
   while (!tstack.empty()) {
 
-    BVHNode *current = tstack.top();
+    size_t current = tstack.top();
     tstack.pop();
 
-    current->bb.draw(cnode, cnode_alpha);
-    if (current->l) tstack.push(current->l);
-    if (current->r) tstack.push(current->r);
+    const LinearBVHNode &node = bvh->get_node(current);
+    node.bbox().draw(cnode, cnode_alpha);
+    if (!node.isLeaf()) {
+      tstack.push(bvh->left_child(current));
+      tstack.push(bvh->right_child(current));
+    }
   }
 
   // draw selected node bbox and primitives
-  if (selected->l) selected->l->bb.draw(cnode_hl_child, cnode_hl_child_alpha);
-  if (selected->r) selected->r->bb.draw(cnode_hl_child, cnode_hl_child_alpha);
+  if (!selected_node.isLeaf()) {
+    bvh->get_node(bvh->left_child(selected)).bbox().draw(cnode_hl_child, cnode_hl_child_alpha);
+    bvh->get_node(bvh->right_child(selected)).bbox().draw(cnode_hl_child, cnode_hl_child_alpha);
+  }
 
   glLineWidth(3.f);
-  selected->bb.draw(cnode_hl, cnode_hl_alpha);
+  selected_node.bbox().draw(cnode_hl, cnode_hl_alpha);
 
   // now perform visualization of the rays
   if (show_rays) {
@@ -508,7 +825,7 @@ void RaytracedRenderer::visualize_cell() const {
  * If the pathtracer is in VISUALIZE, handle key presses to traverse the bvh.
  */
 void RaytracedRenderer::key_press(int key) {
-  BVHNode *current = selectionHistory.top();
+  size_t current = selectionHistory.top();
   switch (key) {
   case ']':
     pt->ns_aa *=2;
@@ -563,13 +880,13 @@ void RaytracedRenderer::key_press(int key) {
     }
     break;
   case KEYBOARD_LEFT:
-    if (current->l) {
-        selectionHistory.push(current->l);
+    if (!bvh->get_node(current).isLeaf()) {
+        selectionHistory.push(bvh->left_child(current));
     }
     break;
   case KEYBOARD_RIGHT:
-    if (current->l) {
-        selectionHistory.push(current->r);
+    if (!bvh->get_node(current).isLeaf()) {
+        selectionHistory.push(bvh->right_child(current));
     }
     break;
 
@@ -607,10 +924,23 @@ void RaytracedRenderer::raytrace_tile(int tile_x, int tile_y,
   size_t tile_idx_y = tile_y / imageTileSize;
   size_t num_samples_tile = tile_samples[tile_idx_x + tile_idx_y * num_tiles_w];
 
-  for (size_t y = tile_start_y; y < tile_end_y; y++) {
+  if (pt->stream_tracing) {
     if (!continueRaytracing) return;
-    for (size_t x = tile_start_x; x < tile_end_x; x++) {
-      pt->raytrace_pixel(x, y);
+    pt->raytrace_tile_stream(tile_start_x, tile_start_y, tile_end_x, tile_end_y);
+  } else if (pt->packet_tracing) {
+    for (size_t y = tile_start_y; y < tile_end_y; y += BVH_PACKET_WIDTH) {
+      if (!continueRaytracing) return;
+      for (size_t x = tile_start_x; x < tile_end_x; x += BVH_PACKET_WIDTH) {
+        pt->raytrace_block(x, y, std::min<size_t>(x + BVH_PACKET_WIDTH, tile_end_x),
+                           std::min<size_t>(y + BVH_PACKET_WIDTH, tile_end_y));
+      }
+    }
+  } else {
+    for (size_t y = tile_start_y; y < tile_end_y; y++) {
+      if (!continueRaytracing) return;
+      for (size_t x = tile_start_x; x < tile_end_x; x++) {
+        pt->raytrace_pixel(x, y);
+      }
     }
   }
 
@@ -636,7 +966,10 @@ void RaytracedRenderer::raytrace_cell(ImageBuffer& buffer) {
   {
     unique_lock<std::mutex> lk(m_done);
     start_raytracing();
-    cv_done.wait(lk, [this]{ return state == DONE; });
+    while (!cv_done.wait_for(lk, std::chrono::milliseconds(PROGRESS_REPORT_MS),
+                             [this]{ return state == DONE; })) {
+      report_progress();
+    }
     lk.unlock();
   }
 
@@ -651,45 +984,86 @@ void RaytracedRenderer::autofocus(Vector2D loc) {
   pt->autofocus(loc);
 }
 
-void RaytracedRenderer::worker_thread() {
+void RaytracedRenderer::worker_thread(size_t worker) {
+  uint64_t generation = 0;
+  while (true) {
+    {
+      unique_lock<std::mutex> lk(m_workers);
+      cv_job.wait(lk, [&]{ return shutdownWorkers || jobGeneration != generation; });
+      if (shutdownWorkers) return;
+      generation = jobGeneration;
+    }
 
-  Timer timer;
-  timer.start();
+    raytrace_tiles(worker);
+
+    lock_guard<std::mutex> lk(m_workers);
+    if (--workersBusy == 0) cv_idle.notify_all();
+  }
+}
+
+void RaytracedRenderer::wait_for_workers() {
+  unique_lock<std::mutex> lk(m_workers);
+  cv_idle.wait(lk, [this]{ return workersBusy == 0; });
+}
+
+void RaytracedRenderer::raytrace_tiles(size_t worker) {
 
   WorkItem work;
-  while (continueRaytracing && workQueue.try_get_work(&work)) {
+  while (continueRaytracing && workQueue.try_get_work(worker, &work)) {
     raytrace_tile(work.tile_x, work.tile_y, work.tile_w, work.tile_h);
-    { 
-      lock_guard<std::mutex> lk(m_done);
-      ++tilesDone;
-      cout << "\r[PathTracer] Rendering... " << int((double)tilesDone/tilesTotal * 100) << '%';
-      cout.flush();
-    }
+    tilesDone.fetch_add(1, std::memory_order_relaxed);
   }
 
-  workerDoneCount++;
-  if (!continueRaytracing && workerDoneCount == numWorkerThreads) {
-    timer.stop();
+  // the last worker to finish the pass starts the next one
+  if (++workerDoneCount != numWorkerThreads) return;
+
+  if (!continueRaytracing) {
+    renderTimer.stop();
     fprintf(stdout, "\n[PathTracer] Rendering canceled!\n");
     state = READY;
+    return;
   }
 
-  if (continueRaytracing && workerDoneCount == numWorkerThreads) {
-    timer.stop();
-    fprintf(stdout, "\r[PathTracer] Rendering... 100%%! (%.4fs)\n", timer.duration());
-    fprintf(stdout, "[PathTracer] BVH traced %llu rays.\n", bvh->total_rays);
-    fprintf(stdout, "[PathTracer] Average speed %.4f million rays per second.\n", (double)bvh->total_rays / timer.duration() * 1e-6);
-    fprintf(stdout, "[PathTracer] Averaged %f intersection tests per ray.\n", (((double)bvh->total_isects)/bvh->total_rays));
+  // with a time budget, only start another pass if one as long as the
+  // last still fits in it
+  renderTimer.stop();
+  double elapsed = renderTimer.duration();
+  bool budget_left = timeBudget <= 0 || 2 * elapsed - passStartTime <= timeBudget;
+  passStartTime = elapsed;
 
-    lock_guard<std::mutex> lk(m_done);
-    state = DONE;
-    cv_done.notify_one();
+  if (++passesDone < numPasses && budget_left) {
+    start_pass();
+    return;
   }
+
+  fprintf(stdout, "\r[PathTracer] Rendering... 100%%! (%.4fs)\n", renderTimer.duration());
+  fprintf(stdout, "[PathTracer] BVH traced %llu rays.\n", bvh->total_rays);
+  fprintf(stdout, "[PathTracer] Average speed %.4f million rays per second.\n", (double)bvh->total_rays / renderTimer.duration() * 1e-6);
+  fprintf(stdout, "[PathTracer] Averaged %f intersection tests per ray.\n", (((double)bvh->total_isects)/bvh->total_rays));
+
+  lock_guard<std::mutex> lk(m_done);
+  state = DONE;
+  cv_done.notify_one();
+}
+
+void RaytracedRenderer::report_progress() {
+  if (state != RENDERING || tilesTotal == 0) return;
+  int percent = int((double)tilesDone.load(std::memory_order_relaxed) / tilesTotal * 100);
+  if (timeBudget > 0) {
+    // the render usually ends on the budget before its last pass
+    progressTimer.stop();
+    percent = max(percent, min(99, int(progressTimer.duration() / timeBudget * 100)));
+  }
+  if (percent == progressReported) return;
+  progressReported = percent;
+  fprintf(stdout, "\r[PathTracer] Rendering... %d%%", percent);
+  fflush(stdout);
 }
 
 void RaytracedRenderer::save_image(string filename, ImageBuffer* buffer) {
 
-  if (state != DONE) return;
+  bool refined = state == RENDERING && numPasses > 1 && passesDone > 0;
+  if (state != DONE && !refined) return;
 
   if (!buffer)
     buffer = &frameBuffer;
@@ -12,6 +12,8 @@
 #include "CGL/timer.h"
 
 #include "scene/bvh.h"
+#include "scene/instance.h"
+#include "scene/object.h"
 #include "pathtracer/camera.h"
 #include "pathtracer/sampler.h"
 #include "util/image.h"
@@ -27,7 +29,10 @@ using CGL::SceneObjects::Scene;
 using CGL::SceneObjects::EnvironmentLight;
 
 using CGL::SceneObjects::BVHNode;
+using CGL::SceneObjects::LinearBVHNode;
 using CGL::SceneObjects::BVHAccel;
+using CGL::SceneObjects::BVHBuildMethod;
+using CGL::SceneObjects::BVHLayout;
 
 #include "pathtracer.h"
 
@@ -74,7 +79,17 @@ public:
              bool direct_hemisphere_sample = false,
              string filename = "",
              double lensRadius = 0.25,
-             double focalDistance = 4.7);
+             double focalDistance = 4.7,
+             BVHBuildMethod bvh_build_method = CGL::SceneObjects::BVH_BUILD_SAH,
+             BVHLayout bvh_layout = CGL::SceneObjects::BVH_LAYOUT_BINARY,
+             double bvh_duplication_budget = 0.3,
+             bool bvh_instancing = false,
+             string bvh_cache_dir = "",
+             bool bvh_treelets = false,
+             bool packet_tracing = false,
+             bool stream_tracing = false,
+             size_t pass_samples = 0,
+             double time_budget = 0);
 
   /**
    * Destructor.
@@ -109,6 +124,15 @@ public:
    */
   void set_frame_size(size_t width, size_t height);
 
+  /**
+   * Build a BVH over the primitives of the scene with every build method
+   * and a range of leaf sizes, and print their build time, memory use and
+   * quality measures. Nothing is built for rendering, and the primitives are
+   * taken as they are in world space, whatever the instancing setting.
+   * \param scene the scene to measure, not owned
+   */
+  void report_bvh_stats(Scene* scene);
+
   /**
    * Update result on screen.
    * If the pathtracer is in RENDERING or DONE, it will display the result in
@@ -142,6 +166,12 @@ public:
    */
   void start_raytracing();
 
+  /**
+   * Render the image, or the cell of it at (x, y) of size (dx, dy) unless x
+   * is -1, and save it to the given file. With a time budget, the render
+   * stops after the last pass that fits in it, and the samples per pixel
+   * achieved are reported.
+   */
   void render_to_file(std::string filename, size_t x, size_t y, size_t dx, size_t dy);
 
   void raytrace_cell(ImageBuffer& buffer);
@@ -152,7 +182,8 @@ public:
   void key_press(int key);
 
   /**
-   * Save rendered result to png file.
+   * Save rendered result to png file. In progressive mode, the result of
+   * the passes done so far can be saved while rendering.
    */
   void save_image(std::string filename="", ImageBuffer* buffer=NULL);
 
@@ -173,6 +204,19 @@ public:
    */
   void build_accel();
 
+  /**
+   * Build one object space BVH per distinct mesh geometry and collect an
+   * instance of it for every mesh, plus the primitives of all the other
+   * objects, as the primitives of the top-level BVH. The BVHs of earlier
+   * scenes are reused for geometry that is still there.
+   */
+  void build_instances(std::vector<CGL::SceneObjects::Primitive*>& primitives);
+
+  /**
+   * Delete the BVH, the instances and the shared instance BVHs.
+   */
+  void delete_accel();
+
   /**
    * Visualize acceleration structures.
    */
@@ -187,9 +231,36 @@ public:
   void raytrace_tile(int tile_x, int tile_y, int tile_w, int tile_h);
 
   /**
-   * Implementation of a ray tracer worker thread
+   * Implementation of a ray tracer worker thread. Workers live as long as
+   * the renderer: they sleep until a render starts a new job generation,
+   * render tiles until it runs out of them, and go back to sleep.
+   * \param worker index of the worker, selects its run of tiles
+   */
+  void worker_thread(size_t worker);
+
+  /**
+   * Render the tiles of the current job. Is run in a worker thread.
+   * \param worker index of the worker, selects its run of tiles
+   */
+  void raytrace_tiles(size_t worker);
+
+  /**
+   * Wait until every worker has left the current job.
+   */
+  void wait_for_workers();
+
+  /**
+   * Hand all the tiles to the workers again and wake them up for the next
+   * pass over the image.
+   */
+  void start_pass();
+
+  /**
+   * Print the rendering progress if it changed since it was last printed.
+   * Only called from the thread that started the render, so that the
+   * workers never wait on each other to report.
    */
-  void worker_thread();
+  void report_progress();
 
   enum State {
     INIT,               ///< to be initialized
@@ -209,7 +280,12 @@ public:
 
   // Integration state //
 
-  vector<int> tile_samples; ///< current sample rate for tile
+  vector<int> tile_samples; ///< passes done over the tile
+  vector<WorkItem> tiles;   ///< tiles of the image, rendered by every pass
+  size_t numPasses;         ///< passes over the tiles of a render
+  std::atomic<size_t> passesDone;  ///< passes finished by the workers
+  double timeBudget;        ///< seconds a render may take, 0 for no limit
+  double passStartTime;     ///< render time at which the current pass began
   size_t num_tiles_w;       ///< number of tiles along width of the image
   size_t num_tiles_h;       ///< number of tiles along height of the image
 
@@ -218,9 +294,21 @@ public:
   double lensRadius;
   double focalDistance;
 
+  BVHBuildMethod bvhBuildMethod;  ///< strategy used to build the BVH
+  BVHLayout bvhLayout;            ///< node layout used to traverse the BVH
+  double bvhDuplicationBudget;    ///< spatial split reference budget
+  bool bvhInstancing;             ///< build a two-level BVH over instances
+  string bvhCacheDir;             ///< directory of BVH cache files, or empty
+  bool bvhTreelets;               ///< store wide BVH nodes in treelets
+  uint64_t bvhTopology;           ///< scene topology the BVH was built for
+  double bvhBuildCost;            ///< SAH cost of the BVH when it was built
+
   // Components //
 
   BVHAccel* bvh;                 ///< BVH accelerator aggregate
+  std::vector<BVHAccel*> instanceBVHs;  ///< bottom-level BVHs shared by instances
+  std::vector<CGL::SceneObjects::Mesh*> instanceGeometry;  ///< object space geometry of every instance BVH
+  std::vector<CGL::SceneObjects::BVHInstance*> instances;  ///< primitives of the top-level BVH over the instance BVHs
   ImageBuffer frameBuffer;       ///< frame buffer
   Timer timer;                   ///< performance test timer
 
@@ -234,15 +322,24 @@ public:
   bool continueRaytracing;                  ///< rendering should continue
   std::vector<std::thread*> workerThreads;  ///< pool of worker threads
   std::atomic<int> workerDoneCount;         ///< worker threads management
-  WorkQueue<WorkItem> workQueue;            ///< queue of work for the workers
+  std::mutex m_workers;                     ///< guards the job state below
+  std::condition_variable cv_job;           ///< wakes workers for a new job
+  std::condition_variable cv_idle;          ///< signals workers leaving a job
+  uint64_t jobGeneration;                   ///< bumped for every render
+  size_t workersBusy;                       ///< workers still on the job
+  bool shutdownWorkers;                     ///< workers should exit
+  Timer renderTimer;                        ///< time of the current render
+  Timer progressTimer;                      ///< the same, read by report_progress
+  WorkStealingQueue<WorkItem> workQueue;    ///< tiles of the workers
   std::condition_variable cv_done;
   std::mutex m_done;
-  size_t tilesDone;
+  std::atomic<size_t> tilesDone;            ///< tiles finished by the workers
   size_t tilesTotal;
+  int progressReported;                     ///< last percentage printed
 
   // Visualizer Controls //
 
-  std::stack<BVHNode*> selectionHistory;  ///< node selection history
+  std::stack<size_t> selectionHistory;    ///< node selection history
   std::vector<LoggedRay> rayLog;          ///< ray tracing log
   bool show_rays;                         ///< show rays from raylog
   
@@ -8,6 +8,10 @@
 
 #include "pathtracer/ray.h"
 
+// gamma(3) = 3 eps / (1 - 3 eps) bounds the relative error of three double
+// operations, used to make the slab test conservative.
+#define BBOX_GAMMA_3 (3 * 1.1102230246251565e-16 / (1 - 3 * 1.1102230246251565e-16))
+
 namespace CGL {
 
 /**
@@ -93,6 +97,19 @@ struct BBox {
     extent = max - min;
   }
 
+  /**
+   * Intersect the bounding box with another one.
+   * \param bbox the bounding box to intersect with
+   * \return the part of space inside both boxes, an empty box if they do
+   *         not overlap
+   */
+  BBox intersection(const BBox& bbox) const {
+    BBox result(std::max(min.x, bbox.min.x), std::max(min.y, bbox.min.y),
+                std::max(min.z, bbox.min.z), std::min(max.x, bbox.max.x),
+                std::min(max.y, bbox.max.y), std::min(max.z, bbox.max.z));
+    return result.empty() ? BBox() : result;
+  }
+
   Vector3D centroid() const {
     return (min + max) / 2;
   }
@@ -119,14 +136,38 @@ struct BBox {
     return min.x > max.x || min.y > max.y || min.z > max.z;
   }
 
+  /**
+   * Get the min (0) or max (1) corner, as selected by a ray direction sign.
+   */
+  inline const Vector3D& bound(int i) const { return i ? max : min; }
+
   /**
    * Ray - bbox intersection.
    * Intersects ray with bounding box, does not store shading information.
+   * The near and far slabs are picked from the precomputed direction signs
+   * of the ray, so the test needs no divisions and no swaps. NaNs (0 * inf,
+   * for rays in the plane of a slab) leave the interval untouched.
    * \param r the ray to intersect with
-   * \param t0 lower bound of intersection time
-   * \param t1 upper bound of intersection time
+   * \param t0 lower bound of intersection time, set to the entry time
+   * \param t1 upper bound of intersection time, set to the exit time
+   * \return true if the ray overlaps the box within [t0, t1], t0 and t1
+   *         are only updated in that case
    */
-  bool intersect(const Ray& r, double& t0, double& t1) const;
+  inline bool intersect(const Ray& r, double& t0, double& t1) const {
+    double t_enter = t0, t_exit = t1;
+    for (int a = 0; a < 3; a++) {
+      double t_near = (bound(r.sign[a])[a] - r.o[a]) * r.inv_d[a];
+      double t_far  = (bound(1 - r.sign[a])[a] - r.o[a]) * r.inv_d[a];
+      // account for the rounding of the subtraction and the product
+      t_far *= 1 + 2 * BBOX_GAMMA_3;
+      t_enter = t_near > t_enter ? t_near : t_enter;
+      t_exit  = t_far  < t_exit  ? t_far  : t_exit;
+    }
+    if (t_enter > t_exit) return false;
+    t0 = t_enter;
+    t1 = t_exit;
+    return true;
+  }
 
   /**
    * Draw box wireframe with OpenGL.
@@ -2,55 +2,295 @@
 
 #include "CGL/CGL.h"
 #include "triangle.h"
+#include "util/parallel.h"
 
+#include <algorithm>
+#include <cassert>
+#include <cmath>
 #include <iostream>
 #include <stack>
+#include <thread>
 
 using namespace std;
 
 namespace CGL {
 namespace SceneObjects {
 
+// Number of buckets the centroids are binned into when evaluating SAH splits.
+static const int SAH_NUM_BUCKETS = 16;
+
+// Nodes with at least this many primitives fork their subtrees onto
+// separate threads while construction threads are available.
+static const size_t PARALLEL_BUILD_THRESHOLD = 4096;
+
+// Nodes with at least this many primitives bin and partition in parallel.
+static const size_t PARALLEL_BIN_THRESHOLD = 65536;
+
+struct SAHBucket {
+  SAHBucket() : count(0) { }
+
+  size_t count;   ///< number of primitives whose centroid falls in the bucket
+  BBox bb;        ///< bounds of those primitives
+};
+
+// Subtrees deeper than this are split at the median so that the tree stays
+// within the traversal stack size.
+static const size_t SAH_MAX_DEPTH = 64;
+
 BVHAccel::BVHAccel(const std::vector<Primitive *> &_primitives,
-                   size_t max_leaf_size) {
+                   size_t max_leaf_size, BVHBuildMethod method,
+                   size_t num_threads, BVHLayout layout,
+                   double duplication_budget, bool treelets)
+    : total_rays(0), total_isects(0), method(method), layout(layout),
+      treelets(treelets) {
 
   primitives = std::vector<Primitive *>(_primitives);
-  root = construct_bvh(primitives.begin(), primitives.end(), max_leaf_size);
+  num_input_primitives = primitives.size();
+  num_threads = std::max<size_t>(num_threads, 1);
+  BVHNode *root;
+  if (method == BVH_BUILD_LBVH) {
+    root = construct_lbvh(max_leaf_size, num_threads);
+  } else if (method == BVH_BUILD_SBVH) {
+    root = construct_sbvh(max_leaf_size, duplication_budget);
+  } else {
+    root = construct_bvh(primitives.begin(), primitives.end(), max_leaf_size,
+                         num_threads, 0);
+  }
+
+  // flatten the tree and release the build nodes
+  bb = root->bb;
+  nodes.reserve(2 * primitives.size() + 1);
+  flatten(root, 0);
+  nodes.shrink_to_fit();
+  delete root;
+
+  build_wide_nodes();
+
+  // remember which input primitive every leaf reference is, so that refit
+  // can swap in the primitives of a rebuilt scene
+  vector<pair<const Primitive *, uint32_t> > order(_primitives.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = make_pair(_primitives[i], (uint32_t)i);
+  }
+  sort(order.begin(), order.end());
+  input_indices.resize(primitives.size());
+  for (size_t k = 0; k < primitives.size(); k++) {
+    input_indices[k] = lower_bound(order.begin(), order.end(),
+                                   make_pair((const Primitive *)primitives[k], (uint32_t)0))->second;
+  }
+
+  build_leaf_primitives();
+}
+
+void BVHAccel::build_wide_nodes() {
+  wide4_nodes.clear();
+  wide8_nodes.clear();
+  qwide4_nodes.clear();
+  qwide8_nodes.clear();
+  if (layout == BVH_LAYOUT_WIDE4 || layout == BVH_LAYOUT_QWIDE4) {
+    collapse(0, wide4_nodes);
+    wide4_nodes.shrink_to_fit();
+    if (treelets) reorder_treelets(wide4_nodes);
+  } else if (layout == BVH_LAYOUT_WIDE8 || layout == BVH_LAYOUT_QWIDE8) {
+    collapse(0, wide8_nodes);
+    wide8_nodes.shrink_to_fit();
+    if (treelets) reorder_treelets(wide8_nodes);
+  }
+
+  // the quantized layouts only keep the quantized nodes
+  if (layout == BVH_LAYOUT_QWIDE4) {
+    quantize(wide4_nodes, qwide4_nodes);
+    WideBVHNodeVector<4>().swap(wide4_nodes);
+  } else if (layout == BVH_LAYOUT_QWIDE8) {
+    quantize(wide8_nodes, qwide8_nodes);
+    WideBVHNodeVector<8>().swap(wide8_nodes);
+  }
+}
+
+size_t BVHAccel::get_node_memory() const {
+  switch (layout) {
+    case BVH_LAYOUT_WIDE4:  return wide4_nodes.size() * sizeof(WideBVHNode<4>);
+    case BVH_LAYOUT_WIDE8:  return wide8_nodes.size() * sizeof(WideBVHNode<8>);
+    case BVH_LAYOUT_QWIDE4: return qwide4_nodes.size() * sizeof(QuantizedBVHNode<4>);
+    case BVH_LAYOUT_QWIDE8: return qwide8_nodes.size() * sizeof(QuantizedBVHNode<8>);
+    default:                return nodes.size() * sizeof(LinearBVHNode);
+  }
+}
+
+size_t BVHAccel::get_memory() const {
+  size_t memory = get_node_memory();
+  if (layout != BVH_LAYOUT_BINARY) memory += nodes.size() * sizeof(LinearBVHNode);
+  return memory + primitives.size() * sizeof(Primitive *) +
+         input_indices.size() * sizeof(uint32_t) +
+         leaf_primitives.size() * sizeof(LeafPrimitives) +
+         leaf_starts.size() * sizeof(LeafStarts) +
+         triangle_blocks.size() * sizeof(TriangleBlock) +
+         spheres.size() * sizeof(LeafSphere);
+}
+
+double BVHAccel::refit(const std::vector<Primitive *> *new_primitives) {
+  if (new_primitives) {
+    if (new_primitives->size() != num_input_primitives) return INF_D;
+    for (size_t k = 0; k < primitives.size(); k++) {
+      primitives[k] = (*new_primitives)[input_indices[k]];
+    }
+  }
+
+  // children are stored after their parent, so sweeping the nodes
+  // backwards updates both children before the node itself
+  bb = BBox();
+  for (size_t n = nodes.size(); n-- > 0;) {
+    LinearBVHNode &node = nodes[n];
+    if (node.isLeaf()) {
+      BBox leaf_bb;
+      for (uint32_t p = 0; p < node.n_primitives; p++) {
+        leaf_bb.expand(primitives[node.primitives_offset + p]->get_bbox());
+      }
+      node.set_bbox(leaf_bb);
+      bb.expand(leaf_bb);
+    } else {
+      const LinearBVHNode &l = nodes[left_child(n)];
+      const LinearBVHNode &r = nodes[right_child(n)];
+      for (int a = 0; a < 3; a++) {
+        node.min[a] = std::min(l.min[a], r.min[a]);
+        node.max[a] = std::max(l.max[a], r.max[a]);
+      }
+    }
+  }
+
+  build_wide_nodes();
+  build_leaf_primitives();
+  return get_sah_cost();
+}
+
+double BVHAccel::get_sah_cost() const {
+  if (nodes.empty()) return 0;
+  double root_area = nodes[0].bbox().surface_area();
+  if (root_area <= 0) return 0;
+
+  double cost = 0;
+  for (const LinearBVHNode &node : nodes) {
+    double p = node.bbox().surface_area() / root_area;
+    cost += node.isLeaf() ? p * node.n_primitives : p;
+  }
+  return cost;
+}
+
+BVHStats BVHAccel::get_stats() const {
+  BVHStats stats;
+  stats.sah_cost = get_sah_cost();
+  stats.num_nodes = nodes.size();
+  stats.num_leaves = 0;
+  stats.max_depth = 0;
+  stats.overlap = 0;
+  stats.memory = get_memory();
+  if (nodes.empty()) return stats;
+
+  // children always come after their parent, so one forward sweep sees
+  // the depth of every parent before its children
+  double root_area = nodes[0].bbox().surface_area();
+  vector<size_t> depth(nodes.size(), 0);
+  for (size_t i = 0; i < nodes.size(); i++) {
+    const LinearBVHNode &node = nodes[i];
+    if (node.isLeaf()) {
+      stats.num_leaves++;
+      stats.max_depth = std::max(stats.max_depth, depth[i]);
+      if (stats.leaf_depths.size() <= depth[i]) stats.leaf_depths.resize(depth[i] + 1, 0);
+      stats.leaf_depths[depth[i]]++;
+      if (stats.leaf_sizes.size() <= node.n_primitives) stats.leaf_sizes.resize(node.n_primitives + 1, 0);
+      stats.leaf_sizes[node.n_primitives]++;
+      continue;
+    }
+    depth[left_child(i)] = depth[right_child(i)] = depth[i] + 1;
+    BBox overlap = nodes[left_child(i)].bbox().intersection(nodes[right_child(i)].bbox());
+    if (root_area > 0 && !overlap.empty()) {
+      stats.overlap += overlap.surface_area() / root_area;
+    }
+  }
+  return stats;
 }
 
 BVHAccel::~BVHAccel() {
-  if (root)
-    delete root;
   primitives.clear();
 }
 
-BBox BVHAccel::get_bbox() const { return root->bb; }
+BBox BVHAccel::get_bbox() const { return bb; }
+
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should be 32 bytes");
+
+void LinearBVHNode::set_bbox(const BBox &bb) {
+  for (int a = 0; a < 3; a++) {
+    // round outwards so the float box contains the double one
+    float lo = (float)bb.min[a];
+    float hi = (float)bb.max[a];
+    if (lo > bb.min[a]) lo = std::nextafter(lo, -INF_F);
+    if (hi < bb.max[a]) hi = std::nextafter(hi, INF_F);
+    min[a] = lo;
+    max[a] = hi;
+  }
+}
+
+uint32_t BVHAccel::flatten(const BVHNode *node, size_t depth) {
+  assert(depth < BVH_STACK_SIZE);
+
+  uint32_t index = (uint32_t)nodes.size();
+  nodes.push_back(LinearBVHNode());
+  nodes[index].set_bbox(node->bb);
 
-void BVHAccel::draw(BVHNode *node, const Color &c, float alpha) const {
   if (node->isLeaf()) {
-    for (auto p = node->start; p != node->end; p++) {
-      (*p)->draw(c, alpha);
+    nodes[index].leaf = 1;
+    nodes[index].axis = 0;
+    nodes[index].primitives_offset = (uint32_t)(node->start - primitives.begin());
+    nodes[index].n_primitives = (uint16_t)(node->end - node->start);
+    return index;
+  }
+
+  // the split axis is the one that separates the child centroids the most,
+  // and the first child is the one on its lower side
+  Vector3D d = node->r->bb.centroid() - node->l->bb.centroid();
+  int axis = 0;
+  if (fabs(d.y) > fabs(d[axis])) axis = 1;
+  if (fabs(d.z) > fabs(d[axis])) axis = 2;
+  nodes[index].leaf = 0;
+  nodes[index].axis = (uint8_t)axis;
+  nodes[index].n_primitives = 0;
+
+  const BVHNode *first = node->l, *second = node->r;
+  if (d[axis] < 0) std::swap(first, second);
+  flatten(first, depth + 1);
+  uint32_t second_child = flatten(second, depth + 1);
+  nodes[index].second_child_offset = second_child;
+  return index;
+}
+
+void BVHAccel::draw(size_t node, const Color &c, float alpha) const {
+  const LinearBVHNode &n = nodes[node];
+  if (n.isLeaf()) {
+    for (size_t p = 0; p < n.n_primitives; p++) {
+      primitives[n.primitives_offset + p]->draw(c, alpha);
     }
   } else {
-    draw(node->l, c, alpha);
-    draw(node->r, c, alpha);
+    draw(left_child(node), c, alpha);
+    draw(right_child(node), c, alpha);
   }
 }
 
-void BVHAccel::drawOutline(BVHNode *node, const Color &c, float alpha) const {
-  if (node->isLeaf()) {
-    for (auto p = node->start; p != node->end; p++) {
-      (*p)->drawOutline(c, alpha);
+void BVHAccel::drawOutline(size_t node, const Color &c, float alpha) const {
+  const LinearBVHNode &n = nodes[node];
+  if (n.isLeaf()) {
+    for (size_t p = 0; p < n.n_primitives; p++) {
+      primitives[n.primitives_offset + p]->drawOutline(c, alpha);
     }
   } else {
-    drawOutline(node->l, c, alpha);
-    drawOutline(node->r, c, alpha);
+    drawOutline(left_child(node), c, alpha);
+    drawOutline(right_child(node), c, alpha);
   }
 }
 
 BVHNode *BVHAccel::construct_bvh(std::vector<Primitive *>::iterator start,
                                  std::vector<Primitive *>::iterator end,
-                                 size_t max_leaf_size) {
+                                 size_t max_leaf_size, size_t num_threads,
+                                 size_t depth) {
 
   // TODO (Part 2.1):
   // Construct a BVH from the given vector of primitives and maximum leaf
@@ -58,11 +298,20 @@ BVHNode *BVHAccel::construct_bvh(std::vector<Primitive *>::iterator start,
   // single leaf node (which is also the root) that encloses all the
   // primitives.
 
+  size_t primitive_count = end - start;
+  size_t num_chunks =
+      primitive_count >= PARALLEL_BIN_THRESHOLD ? num_threads : 1;
+
+  std::vector<BBox> chunk_bbox(num_chunks);
+  parallel_for(0, primitive_count, num_chunks,
+               [&](size_t chunk, size_t b, size_t e) {
+    for (size_t i = b; i < e; i++) {
+      chunk_bbox[chunk].expand(start[i]->get_bbox());
+    }
+  });
+
   BBox bbox;
-  int primitive_count = 0;
-  for (auto p = start; p != end; p++) {
-    primitive_count++;
-    BBox bb = (*p)->get_bbox();
+  for (const BBox &bb : chunk_bbox) {
     bbox.expand(bb);
   }
 
@@ -75,65 +324,281 @@ BVHNode *BVHAccel::construct_bvh(std::vector<Primitive *>::iterator start,
     node->l = NULL;
     node->r = NULL;
   } else {
-    node->l = construct_bvh(start, start + primitive_count/2, max_leaf_size);
-    node->r = construct_bvh(start + primitive_count/2, end, max_leaf_size);
+    auto mid = start + primitive_count / 2;
+    if (method == BVH_BUILD_SAH && depth < SAH_MAX_DEPTH) {
+      // fall back to the median split if the centroids can't be separated
+      auto split = partition_sah(start, end, num_chunks);
+      if (split != start && split != end) mid = split;
+    }
+
+    // hand half of the threads to the left subtree while this thread keeps
+    // building the right one
+    if (num_threads > 1 && primitive_count >= PARALLEL_BUILD_THRESHOLD) {
+      size_t left_threads = num_threads / 2;
+      std::thread left([=] {
+        node->l = construct_bvh(start, mid, max_leaf_size, left_threads,
+                                depth + 1);
+      });
+      node->r = construct_bvh(mid, end, max_leaf_size,
+                              num_threads - left_threads, depth + 1);
+      left.join();
+    } else {
+      node->l = construct_bvh(start, mid, max_leaf_size, 1, depth + 1);
+      node->r = construct_bvh(mid, end, max_leaf_size, 1, depth + 1);
+    }
   }
   return node;
 }
 
+std::vector<Primitive *>::iterator
+BVHAccel::partition_sah(std::vector<Primitive *>::iterator start,
+                        std::vector<Primitive *>::iterator end,
+                        size_t num_chunks) {
+
+  size_t primitive_count = end - start;
+
+  // split along the longest axis of the centroid bounds
+  std::vector<BBox> chunk_centroid_box(num_chunks);
+  parallel_for(0, primitive_count, num_chunks,
+               [&](size_t chunk, size_t b, size_t e) {
+    for (size_t i = b; i < e; i++) {
+      chunk_centroid_box[chunk].expand(start[i]->get_bbox().centroid());
+    }
+  });
+
+  BBox centroid_box;
+  for (const BBox &bb : chunk_centroid_box) {
+    centroid_box.expand(bb);
+  }
+
+  int axis = 0;
+  if (centroid_box.extent.y > centroid_box.extent[axis]) axis = 1;
+  if (centroid_box.extent.z > centroid_box.extent[axis]) axis = 2;
+
+  double axis_min = centroid_box.min[axis];
+  double axis_extent = centroid_box.extent[axis];
+  if (axis_extent <= 0) {
+    return start;
+  }
+
+  auto bucket_index = [&](const Primitive *p) {
+    int b = (int)(SAH_NUM_BUCKETS *
+                  (p->get_bbox().centroid()[axis] - axis_min) / axis_extent);
+    return std::min(std::max(b, 0), SAH_NUM_BUCKETS - 1);
+  };
+
+  // every chunk bins into its own set of buckets, merged afterwards
+  std::vector<SAHBucket> chunk_buckets(num_chunks * SAH_NUM_BUCKETS);
+  parallel_for(0, primitive_count, num_chunks,
+               [&](size_t chunk, size_t b, size_t e) {
+    SAHBucket *buckets = &chunk_buckets[chunk * SAH_NUM_BUCKETS];
+    for (size_t i = b; i < e; i++) {
+      SAHBucket &bucket = buckets[bucket_index(start[i])];
+      bucket.count++;
+      bucket.bb.expand(start[i]->get_bbox());
+    }
+  });
+
+  SAHBucket buckets[SAH_NUM_BUCKETS];
+  for (size_t chunk = 0; chunk < num_chunks; chunk++) {
+    for (int i = 0; i < SAH_NUM_BUCKETS; i++) {
+      const SAHBucket &bucket = chunk_buckets[chunk * SAH_NUM_BUCKETS + i];
+      buckets[i].count += bucket.count;
+      buckets[i].bb.expand(bucket.bb);
+    }
+  }
+
+  // sweep from the right to accumulate the bounds of every right-hand side
+  double right_area[SAH_NUM_BUCKETS];
+  size_t right_count[SAH_NUM_BUCKETS];
+  BBox right_bb;
+  size_t count = 0;
+  for (int i = SAH_NUM_BUCKETS - 1; i > 0; i--) {
+    right_bb.expand(buckets[i].bb);
+    count += buckets[i].count;
+    right_area[i] = right_bb.surface_area();
+    right_count[i] = count;
+  }
+
+  // sweep from the left and evaluate the cost of splitting after bucket i.
+  // The costs are not normalized by the parent area since we only need the
+  // relative ordering to pick a split.
+  int best_split = -1;
+  double best_cost = INF_D;
+  BBox left_bb;
+  count = 0;
+  for (int i = 0; i < SAH_NUM_BUCKETS - 1; i++) {
+    left_bb.expand(buckets[i].bb);
+    count += buckets[i].count;
+    if (count == 0 || right_count[i + 1] == 0) continue;
+    double cost = count * left_bb.surface_area() +
+                  right_count[i + 1] * right_area[i + 1];
+    if (cost < best_cost) {
+      best_cost = cost;
+      best_split = i;
+    }
+  }
+
+  if (best_split < 0) {
+    return start;
+  }
+
+  auto goes_left = [&](const Primitive *p) {
+    return bucket_index(p) <= best_split;
+  };
+
+  if (num_chunks == 1) {
+    return std::partition(start, end, goes_left);
+  }
+
+  // parallel partition: count the left side of every chunk, then scatter
+  // each chunk to its offset in a scratch vector and copy back
+  std::vector<size_t> left_counts(num_chunks, 0);
+  parallel_for(0, primitive_count, num_chunks,
+               [&](size_t chunk, size_t b, size_t e) {
+    for (size_t i = b; i < e; i++) {
+      if (goes_left(start[i])) left_counts[chunk]++;
+    }
+  });
+
+  std::vector<size_t> left_offsets(num_chunks), right_offsets(num_chunks);
+  size_t num_left = 0;
+  for (size_t chunk = 0; chunk < num_chunks; chunk++) {
+    left_offsets[chunk] = num_left;
+    num_left += left_counts[chunk];
+  }
+  size_t num_right = num_left;
+  for (size_t chunk = 0; chunk < num_chunks; chunk++) {
+    size_t b = primitive_count * chunk / num_chunks;
+    size_t e = primitive_count * (chunk + 1) / num_chunks;
+    right_offsets[chunk] = num_right;
+    num_right += (e - b) - left_counts[chunk];
+  }
+
+  std::vector<Primitive *> scratch(primitive_count);
+  parallel_for(0, primitive_count, num_chunks,
+               [&](size_t chunk, size_t b, size_t e) {
+    size_t l = left_offsets[chunk], r = right_offsets[chunk];
+    for (size_t i = b; i < e; i++) {
+      if (goes_left(start[i])) {
+        scratch[l++] = start[i];
+      } else {
+        scratch[r++] = start[i];
+      }
+    }
+  });
 
-bool BVHAccel::has_intersection(const Ray &ray, BVHNode *node) const {
+  parallel_for(0, primitive_count, num_chunks,
+               [&](size_t /*chunk*/, size_t b, size_t e) {
+    std::copy(scratch.begin() + b, scratch.begin() + e, start + b);
+  });
+
+  return start + num_left;
+}
+
+bool BVHAccel::has_intersection(const Ray &ray) const {
   // TODO (Part 2.3):
   // Fill in the intersect function.
   // Take note that this function has a short-circuit that the
   // Intersection version cannot, since it returns as soon as it finds
   // a hit, it doesn't actually have to find the closest hit.
 
-  for (auto p : primitives) {
-  total_isects++;
-  if (p->has_intersection(ray))
-    return true;
-  }
-  return false;
+  if (layout == BVH_LAYOUT_WIDE4)
+    return intersect_wide<WideBVHNode<4>, true>(wide4_nodes, ray, NULL);
+  if (layout == BVH_LAYOUT_WIDE8)
+    return intersect_wide<WideBVHNode<8>, true>(wide8_nodes, ray, NULL);
+  if (layout == BVH_LAYOUT_QWIDE4)
+    return intersect_wide<QuantizedBVHNode<4>, true>(qwide4_nodes, ray, NULL);
+  if (layout == BVH_LAYOUT_QWIDE8)
+    return intersect_wide<QuantizedBVHNode<8>, true>(qwide8_nodes, ray, NULL);
 
+  ++total_rays;
+  return has_intersection_from(0, ray);
 }
 
-bool BVHAccel::intersect(const Ray &ray, Intersection *i, BVHNode *node) const {
-  // TODO (Part 2.3):
-  // Fill in the intersect function.
-  if (node == NULL) {
-    return false;
-  }
-  if (!(node->bb.intersect(ray, ray.min_t, ray.max_t))) {
-    return false;
+bool BVHAccel::has_intersection_from(uint32_t root, const Ray &ray) const {
+  float o[3], inv_d[3];
+  for (int a = 0; a < 3; a++) {
+    o[a] = (float)ray.o[a];
+    inv_d[a] = (float)ray.inv_d[a];
   }
 
-  bool hit1 = false;
-  bool hit2 = false;
-
-  if (node->isLeaf()) {
-    bool hit3 = false;
-    for (auto p = node->start; p != node->end; p++) {
-      bool result = (*p)->intersect(ray, i);
-      hit3 = hit3 || result;
-      if (result) {
-        total_isects++;
+  uint32_t stack[BVH_STACK_SIZE];
+  int stack_size = 0;
+  uint32_t current = root;
+  while (true) {
+    const LinearBVHNode &node = nodes[current];
+    float t0 = ray.min_t, t1 = ray.max_t;
+    if (node.intersect(o, inv_d, ray.sign, t0, t1)) {
+      if (node.isLeaf()) {
+        if (has_intersection_leaf(node.primitives_offset, node.n_primitives, ray))
+          return true;
+      } else {
+        stack[stack_size++] = node.second_child_offset;
+        current = current + 1;
+        continue;
       }
     }
-    return hit3;
-  }
-  if (node->l) {
-    hit1 = intersect(ray, i, node->l);
+    if (stack_size == 0) break;
+    current = stack[--stack_size];
   }
-  if (node->r) {
-    hit2 = intersect(ray, i, node->r);
-  }
-  // hit1 = intersect(ray, i, node->l);
-  // hit2 = intersect(ray, i, node->r);
+  return false;
+}
+
+bool BVHAccel::intersect(const Ray &ray, Intersection *i) const {
+  // TODO (Part 2.3):
+  // Fill in the intersect function.
+
+  if (layout == BVH_LAYOUT_WIDE4)
+    return intersect_wide<WideBVHNode<4>, false>(wide4_nodes, ray, i);
+  if (layout == BVH_LAYOUT_WIDE8)
+    return intersect_wide<WideBVHNode<8>, false>(wide8_nodes, ray, i);
+  if (layout == BVH_LAYOUT_QWIDE4)
+    return intersect_wide<QuantizedBVHNode<4>, false>(qwide4_nodes, ray, i);
+  if (layout == BVH_LAYOUT_QWIDE8)
+    return intersect_wide<QuantizedBVHNode<8>, false>(qwide8_nodes, ray, i);
 
-  return hit1 || hit2;
+  ++total_rays;
+  return intersect_from(0, ray, i);
+}
 
+bool BVHAccel::intersect_from(uint32_t root, const Ray &ray, Intersection *i) const {
+  float o[3], inv_d[3];
+  for (int a = 0; a < 3; a++) {
+    o[a] = (float)ray.o[a];
+    inv_d[a] = (float)ray.inv_d[a];
+  }
 
+  // Nodes are tested against the current ray.max_t when they are popped,
+  // so once a hit is found the children entering the ray behind it are
+  // skipped. Visiting the nearer child first finds close hits early.
+  bool hit = false;
+  uint32_t stack[BVH_STACK_SIZE];
+  int stack_size = 0;
+  uint32_t current = root;
+  while (true) {
+    const LinearBVHNode &node = nodes[current];
+    float t0 = ray.min_t, t1 = ray.max_t;
+    if (node.intersect(o, inv_d, ray.sign, t0, t1)) {
+      if (node.isLeaf()) {
+        if (intersect_leaf(node.primitives_offset, node.n_primitives, ray, i))
+          hit = true;
+      } else {
+        // the first child lies on the lower side of the split axis
+        if (ray.sign[node.axis]) {
+          stack[stack_size++] = current + 1;
+          current = node.second_child_offset;
+        } else {
+          stack[stack_size++] = node.second_child_offset;
+          current = current + 1;
+        }
+        continue;
+      }
+    }
+    if (stack_size == 0) break;
+    current = stack[--stack_size];
+  }
+  return hit;
 }
 
 } // namespace SceneObjects
@@ -3,14 +3,81 @@
 
 #include "scene.h"
 #include "aggregate.h"
+#include "util/aligned_allocator.h"
 
+#include <cstdint>
+#include <string>
 #include <vector>
 
 namespace CGL { namespace SceneObjects {
 
+/**
+ * Strategies used to split an interior node during BVH construction.
+ */
+enum BVHBuildMethod {
+  BVH_BUILD_MEDIAN,   ///< split at the primitive-count median, in input order
+  BVH_BUILD_SAH,      ///< binned surface area heuristic on the longest axis
+  BVH_BUILD_LBVH,     ///< Morton-code linear BVH with SAH-built top levels
+  BVH_BUILD_SBVH      ///< SAH with spatial splits that duplicate references
+};
+
+/**
+ * Short name of a build method, as accepted on the command line.
+ */
+inline const char* bvh_build_method_name(BVHBuildMethod method) {
+  switch (method) {
+    case BVH_BUILD_MEDIAN: return "median";
+    case BVH_BUILD_SAH:    return "sah";
+    case BVH_BUILD_LBVH:   return "lbvh";
+    case BVH_BUILD_SBVH:   return "sbvh";
+  }
+  return "unknown";
+}
+
+/**
+ * Node layouts the BVH can be traversed with.
+ */
+enum BVHLayout {
+  BVH_LAYOUT_BINARY,  ///< two children per node, one box test at a time
+  BVH_LAYOUT_WIDE4,   ///< four children per node, tested together with SSE
+  BVH_LAYOUT_WIDE8,   ///< eight children per node, tested together with AVX
+  BVH_LAYOUT_QWIDE4,  ///< wide4 with child bounds quantized to 8 bits
+  BVH_LAYOUT_QWIDE8   ///< wide8 with child bounds quantized to 8 bits
+};
+
+/**
+ * Short name of a node layout, as accepted on the command line.
+ */
+inline const char* bvh_layout_name(BVHLayout layout) {
+  switch (layout) {
+    case BVH_LAYOUT_BINARY: return "binary";
+    case BVH_LAYOUT_WIDE4:  return "wide4";
+    case BVH_LAYOUT_WIDE8:  return "wide8";
+    case BVH_LAYOUT_QWIDE4: return "qwide4";
+    case BVH_LAYOUT_QWIDE8: return "qwide8";
+  }
+  return "unknown";
+}
+
+// Size of the traversal stacks. The builders keep the tree shallower than
+// this by falling back to median splits in deep subtrees.
+#define BVH_STACK_SIZE 128
+
+// Ray packets are BVH_PACKET_WIDTH x BVH_PACKET_WIDTH rays, such as the
+// camera rays of a block of pixels.
+#define BVH_PACKET_WIDTH 4
+#define BVH_PACKET_SIZE (BVH_PACKET_WIDTH * BVH_PACKET_WIDTH)
+
+// Leaf triangles are intersected BVH_TRIANGLE_BLOCK_SIZE at a time, which
+// matches the 4 lanes of SSE and the default maximum leaf size.
+#define BVH_TRIANGLE_BLOCK_SIZE 4
+
+// gamma(3) = 3 eps / (1 - 3 eps) bounds the relative error of three float
+// operations, used to make the float slab tests conservative.
+#define BVH_FLOAT_GAMMA_3 (3 * 5.96046448e-8f / (1 - 3 * 5.96046448e-8f))
 
 /**
- * A node in the BVH accelerator aggregate.
+ * A node in the BVH accelerator aggregate, as produced by the builders.
  * The accelerator uses a "flat tree" structure where all the primitives are
  * stored in one vector. A node in the data structure stores only the starting
  * index and the number of primitives in the node and uses this information to
@@ -18,6 +85,8 @@ namespace CGL { namespace SceneObjects {
  * primitives (index + range) are stored on leaf nodes. A leaf node has no child
  * node and its range should be no greater than the maximum leaf size used when
  * constructing the BVH.
+ * Once construction is done the tree is flattened into LinearBVHNodes and
+ * the BVHNodes are freed.
  */
 struct BVHNode {
 
@@ -38,6 +107,180 @@ struct BVHNode {
   std::vector<Primitive*>::const_iterator end;
 };
 
+/**
+ * A node of the flattened BVH used for traversal.
+ * Nodes are stored depth first in one contiguous array, so the first child
+ * of an interior node immediately follows it and only the offset of the
+ * second child is stored. The first child is the one on the lower side of
+ * the split axis, so traversal can visit the nearer child first from the
+ * sign of the ray direction. A leaf stores the range of its primitives in the
+ * primitive vector of the BVH. Bounds are kept in single precision and are
+ * rounded outwards so that they always contain the exact bounds. The node is
+ * exactly 32 bytes so that two nodes fill a cache line.
+ */
+struct LinearBVHNode {
+
+  /**
+   * Set the bounds of the node, rounding them outwards to float.
+   */
+  void set_bbox(const BBox& bb);
+
+  /**
+   * Get the (float precision) bounds of the node.
+   */
+  BBox bbox() const {
+    return BBox(min[0], min[1], min[2], max[0], max[1], max[2]);
+  }
+
+  inline bool isLeaf() const { return leaf != 0; }
+
+  /**
+   * Get the min (0) or max (1) corner, as selected by a ray direction sign.
+   */
+  inline const float* bound(int i) const { return i ? max : min; }
+
+  /**
+   * Ray - node bounds intersection using the precomputed float ray origin,
+   * inverse direction and direction signs. The signs pick the near and far
+   * planes, so the test is branchless min/max arithmetic.
+   * \param o ray origin
+   * \param inv_d component wise inverse of the ray direction
+   * \param sign 1 if the direction is negative along the axis, as in Ray
+   * \param t0 lower bound of intersection time, set to the entry time
+   * \param t1 upper bound of intersection time, set to the exit time
+   * \return true if the ray overlaps the node within [t0, t1], t0 and t1
+   *         are only updated in that case
+   */
+  inline bool intersect(const float o[3], const float inv_d[3], const int sign[3],
+                        float& t0, float& t1) const {
+    float t_enter = t0, t_exit = t1;
+    for (int a = 0; a < 3; a++) {
+      float t_near = (bound(sign[a])[a] - o[a]) * inv_d[a];
+      float t_far  = (bound(1 - sign[a])[a] - o[a]) * inv_d[a];
+      // account for the rounding of the float computations
+      t_far *= 1.0f + 2.0f * BVH_FLOAT_GAMMA_3;
+      // written so that NaNs (0 * inf) leave the interval untouched
+      t_enter = t_near > t_enter ? t_near : t_enter;
+      t_exit  = t_far  < t_exit  ? t_far  : t_exit;
+    }
+    if (t_enter > t_exit) return false;
+    t0 = t_enter;
+    t1 = t_exit;
+    return true;
+  }
+
+  float min[3];   ///< min corner of the bounding box
+  float max[3];   ///< max corner of the bounding box
+  union {
+    uint32_t primitives_offset;     ///< leaf: first primitive of the leaf
+    uint32_t second_child_offset;   ///< interior: index of the second child
+  };
+  uint16_t n_primitives;  ///< leaf: number of primitives
+  uint8_t axis;           ///< interior: axis the children are split along
+  uint8_t leaf;           ///< non zero for leaf nodes
+};
+
+/**
+ * A node of the wide BVH, with up to N children collapsed from the binary
+ * tree. The child bounds are stored as structure of arrays so that one ray
+ * can be tested against all of them with a single SIMD slab test. Unused
+ * child slots have empty (inverted) bounds and are never hit. Interior
+ * children store the index of their wide node, leaf children the range of
+ * their primitives.
+ */
+template <int N>
+struct alignas(64) WideBVHNode {
+  static const int width = N;
+  float min[3][N];              ///< min corners of the children, per axis
+  float max[3][N];              ///< max corners of the children, per axis
+  uint32_t offset[N];           ///< wide node index or first primitive
+  uint16_t n_primitives[N];     ///< leaf children: number of primitives
+  uint8_t leaf_mask;            ///< bit c is set if child c is a leaf
+};
+
+template <int N>
+using WideBVHNodeVector = std::vector<WideBVHNode<N>, AlignedAllocator<WideBVHNode<N>, 64> >;
+
+/**
+ * A wide BVH node with the child bounds quantized to 8 bits per plane,
+ * relative to the box of all children. Along axis a, the quantized value q
+ * stands for origin[a] + q * scale[a]. The scale is a power of two and the
+ * planes are rounded outwards, so the dequantized boxes always contain the
+ * exact ones. Child slots whose bit is clear in child_mask are unused.
+ */
+template <int N>
+struct alignas(16) QuantizedBVHNode {
+  static const int width = N;
+  float origin[3];              ///< min corner of the box of all children
+  float scale[3];               ///< size of one quantization step, per axis
+  uint8_t qmin[3][N];           ///< quantized min corners of the children
+  uint8_t qmax[3][N];           ///< quantized max corners of the children
+  uint32_t offset[N];           ///< wide node index or first primitive
+  uint16_t n_primitives[N];     ///< leaf children: number of primitives
+  uint8_t leaf_mask;            ///< bit c is set if child c is a leaf
+  uint8_t child_mask;           ///< bit c is set if child c is used
+};
+
+template <int N>
+using QuantizedBVHNodeVector = std::vector<QuantizedBVHNode<N>, AlignedAllocator<QuantizedBVHNode<N>, 64> >;
+
+/**
+ * Up to BVH_TRIANGLE_BLOCK_SIZE triangles of a leaf in structure of arrays
+ * single precision layout, one lane per triangle, for the watertight test.
+ * The vertices are stored rather than edges so that triangles sharing a
+ * vertex see exactly the same value. Unused lanes are zero and masked out.
+ */
+struct alignas(16) TriangleBlock {
+  float p[3][3][BVH_TRIANGLE_BLOCK_SIZE];   ///< vertices, per vertex and axis
+};
+
+/**
+ * A sphere of a leaf, stored by value next to the other spheres of the BVH.
+ */
+struct LeafSphere {
+  Vector3D o;   ///< origin of the sphere
+  double r2;    ///< radius squared
+};
+
+/**
+ * Typed runs of a leaf. The references of every leaf are ordered by type:
+ * the triangles first, then the spheres, then any other primitive. Lane k
+ * of triangle block b holds leaf reference BVH_TRIANGLE_BLOCK_SIZE * b + k,
+ * and sphere s the reference num_triangles + s. The references themselves
+ * are only read to record a hit.
+ */
+struct LeafPrimitives {
+  uint32_t first_block;     ///< index of the first triangle block of the leaf
+  uint32_t first_sphere;    ///< index of the first sphere of the leaf
+  uint16_t num_triangles;   ///< number of triangles at the front of the leaf
+  uint16_t num_spheres;     ///< number of spheres following them
+};
+
+/**
+ * 64 consecutive references of a rank bit set marking the first reference
+ * of every leaf. The leaf ordinal of a first reference is the number of
+ * leaves starting before it, found with one popcount, so that the typed
+ * runs are stored per leaf rather than per reference.
+ */
+struct LeafStarts {
+  uint64_t bits;    ///< bit k is set if a leaf starts at reference 64 * word + k
+  uint32_t rank;    ///< number of leaves starting before the word
+};
+
+/**
+ * Quality measures of a built BVH, see BVHAccel::get_stats.
+ */
+struct BVHStats {
+  double sah_cost;                  ///< see BVHAccel::get_sah_cost
+  size_t num_nodes;                 ///< number of binary nodes
+  size_t num_leaves;                ///< number of binary leaves
+  size_t max_depth;                 ///< depth of the deepest leaf, the root is 0
+  double overlap;                   ///< area of all sibling overlaps over root area
+  size_t memory;                    ///< see BVHAccel::get_memory
+  std::vector<size_t> leaf_depths;  ///< number of leaves at every depth
+  std::vector<size_t> leaf_sizes;   ///< number of leaves with every primitive count
+};
+
 /**
  * Bounding Volume Hierarchy for fast Ray - Primitive intersection.
  * Note that the BVHAccel is an Aggregate (A Primitive itself) that contains
@@ -57,8 +300,19 @@ class BVHAccel : public Aggregate {
    * in memory for the aggregate to function properly.
    * \param primitives primitives to build from
    * \param max_leaf_size maximum number of primitives to be stored in leaves
+   * \param method strategy used to split interior nodes
+   * \param num_threads number of threads used for construction
+   * \param layout node layout used for traversal
+   * \param duplication_budget spatial split builder: maximum number of
+   *        duplicated primitive references, as a fraction of the number of
+   *        primitives
+   * \param treelets wide layouts: store the wide nodes in page sized
+   *        treelets instead of depth first order
    */
-  BVHAccel(const std::vector<Primitive*>& primitives, size_t max_leaf_size = 4);
+  BVHAccel(const std::vector<Primitive*>& primitives, size_t max_leaf_size = 4,
+           BVHBuildMethod method = BVH_BUILD_SAH, size_t num_threads = 1,
+           BVHLayout layout = BVH_LAYOUT_BINARY,
+           double duplication_budget = 0.3, bool treelets = false);
 
   /**
    * Destructor.
@@ -81,12 +335,7 @@ class BVHAccel : public Aggregate {
    * \return true if the given ray intersects with the aggregate,
              false otherwise
    */
-  bool has_intersection(const Ray& r) const {
-    ++total_rays;
-    return has_intersection(r, root);
-  }
-
-  bool has_intersection(const Ray& r, BVHNode *node) const;
+  bool has_intersection(const Ray& r) const;
 
   /**
    * Ray - Aggregate intersection 2.
@@ -101,12 +350,47 @@ class BVHAccel : public Aggregate {
    * \return true if the given ray intersects with the aggregate,
              false otherwise
    */
-  bool intersect(const Ray& r, Intersection* i) const {
-    ++total_rays;
-    return intersect(r, i, root);
-  }
+  bool intersect(const Ray& r, Intersection* i) const;
+
+  /**
+   * Ray packet - Aggregate intersection.
+   * Intersects up to BVH_PACKET_SIZE coherent rays together. Nodes are first
+   * culled against the frustum of the whole packet with interval
+   * arithmetic, then tested against the active rays with SIMD. Rays finish
+   * on their own once few of them are left active in a subtree, and all of
+   * them if their directions do not share signs. Implemented in
+   * bvh_packet.cpp.
+   * \param rays rays to test, their max_t is updated as in intersect
+   * \param isects address to store the intersection info of every ray
+   * \param n number of rays, at most BVH_PACKET_SIZE
+   * \return bit mask of the rays that hit the aggregate
+   */
+  uint32_t intersect_packet(const Ray* rays, Intersection* isects, size_t n) const;
+
+  /**
+   * Ray packet - Aggregate intersection, no intersection information is
+   * stored. Every ray stops at its first hit, as in has_intersection.
+   * \param rays rays to test
+   * \param n number of rays, at most BVH_PACKET_SIZE
+   * \return bit mask of the rays that hit the aggregate
+   */
+  uint32_t has_intersection_packet(const Ray* rays, size_t n) const;
 
-  bool intersect(const Ray& r, Intersection* i, BVHNode *node) const;
+  /**
+   * Ray stream - Aggregate intersection.
+   * Intersects a large batch of unrelated rays, such as all the secondary
+   * rays of a bounce. The rays are sorted by direction octant and origin,
+   * then pushed through the binary nodes together: at every node the rays
+   * overlapping it are filtered, four at a time with SIMD, into the list
+   * passed on to its children, so each node is fetched once per stream
+   * instead of once per ray. Implemented in bvh_stream.cpp.
+   * \param rays rays to test, their max_t is updated as in intersect
+   * \param isects address to store the intersection info of every ray
+   * \param hits set to 1 for the rays that hit the aggregate, 0 otherwise
+   * \param n number of rays
+   */
+  void intersect_stream(const Ray* rays, Intersection* isects, uint8_t* hits,
+                        size_t n) const;
 
   /**
    * Get BSDF of the surface material
@@ -116,31 +400,247 @@ class BVHAccel : public Aggregate {
    */
   BSDF* get_bsdf() const { return NULL; }
 
+  /**
+   * Recompute the bounds of all nodes bottom up from the current bounds of
+   * the primitives, keeping the topology of the tree. Used when geometry
+   * moves but its connectivity does not change.
+   * \param new_primitives if not NULL, replaces the primitives the BVH was
+   *        built from. It must hold the corresponding primitives in the same
+   *        order as the vector passed to the constructor.
+   * \return SAH cost of the refitted tree, or infinity if new_primitives
+   *         does not match the BVH
+   */
+  double refit(const std::vector<Primitive*>* new_primitives = NULL);
+
+  /**
+   * Key of the cache file of a BVH built over the given primitives with the
+   * given settings. It hashes the primitive bounds in order, which is all
+   * the object split builders look at. Implemented in bvh_cache.cpp.
+   */
+  static uint64_t cache_key(const std::vector<Primitive*>& primitives,
+                            size_t max_leaf_size, BVHBuildMethod method,
+                            double duplication_budget);
+
+  /**
+   * Write the flattened nodes and the primitive order to a cache file. The
+   * file is written under a temporary name and renamed, so concurrent runs
+   * never see a partial file.
+   * \return true if the file was written
+   */
+  bool save(const std::string& path, uint64_t key) const;
+
+  /**
+   * Load a BVH over the given primitives from a cache file written by save,
+   * without building it. The file is memory mapped where available.
+   * \return the BVH, or NULL if the file is missing, does not match the key
+   *         and the primitives, or is damaged
+   */
+  static BVHAccel* load(const std::string& path, uint64_t key,
+                        const std::vector<Primitive*>& primitives,
+                        BVHLayout layout = BVH_LAYOUT_BINARY,
+                        bool treelets = false);
+
+  /**
+   * Get the SAH cost of the tree: the expected number of node visits and
+   * primitive tests of a random ray that hits the root, with both counted
+   * as one.
+   */
+  double get_sah_cost() const;
+
+  /**
+   * Get the number of primitive references stored in the leaves per input
+   * primitive. Only spatial splits duplicate references, so this is 1 for
+   * all the other builders.
+   */
+  double get_duplication_factor() const {
+    return num_input_primitives ? (double)primitives.size() / num_input_primitives : 1.0;
+  }
+
+  /**
+   * Get the number of bytes used by the nodes the BVH is traversed with,
+   * which are the wide nodes for the wide layouts.
+   */
+  size_t get_node_memory() const;
+
+  /**
+   * Get the number of bytes of everything the BVH holds: the binary nodes,
+   * which the wide layouts keep for the visualizer, the traversal nodes,
+   * the references with their input indices and the leaf arrays, with
+   * their copies of the triangle vertices.
+   */
+  size_t get_memory() const;
+
+  /**
+   * Measure the quality of the tree, for comparing builders and settings.
+   */
+  BVHStats get_stats() const;
+
   /**
    * Get entry point (root) - used in visualizer
    */
-  BVHNode* get_root() const { return root; }
+  size_t get_root() const { return 0; }
+
+  /**
+   * Access the flattened nodes - used in visualizer
+   */
+  const LinearBVHNode& get_node(size_t node) const { return nodes[node]; }
+  size_t left_child(size_t node) const { return node + 1; }
+  size_t right_child(size_t node) const { return nodes[node].second_child_offset; }
+  size_t get_num_nodes() const { return nodes.size(); }
 
   /**
    * Draw the BVH with OpenGL - used in visualizer
    */
   void draw(const Color& c, float alpha) const { }
-  void draw(BVHNode *node, const Color& c, float alpha) const;
+  void draw(size_t node, const Color& c, float alpha) const;
 
   /**
    * Draw the BVH outline with OpenGL - used in visualizer
    */
   void drawOutline(const Color& c, float alpha) const { }
-  void drawOutline(BVHNode *node, const Color& c, float alpha) const;
+  void drawOutline(size_t node, const Color& c, float alpha) const;
 
   mutable unsigned long long total_rays, total_isects;
 
 private:
-  std::vector<Primitive*> primitives;
-  BVHNode* root; ///< root node of the BVH
-  BVHNode *construct_bvh(std::vector<Primitive*>::iterator start, std::vector<Primitive*>::iterator end, size_t max_leaf_size);
+  std::vector<Primitive*> primitives; ///< leaf references, in node order
+  size_t num_input_primitives; ///< primitives the BVH was built from
+  std::vector<uint32_t> input_indices; ///< input position of each leaf reference
+  std::vector<LinearBVHNode, AlignedAllocator<LinearBVHNode, 64> > nodes; ///< flattened nodes, root first
+  BBox bb; ///< exact bounds of all primitives
+  BVHBuildMethod method; ///< strategy used to split interior nodes
+  BVHLayout layout; ///< node layout used for traversal
+  bool treelets; ///< wide nodes are stored in treelets
+
+  // Wide nodes collapsed from the binary ones when a wide layout is used.
+  // The binary nodes are kept for the visualizer.
+  WideBVHNodeVector<4> wide4_nodes;
+  WideBVHNodeVector<8> wide8_nodes;
+  QuantizedBVHNodeVector<4> qwide4_nodes;
+  QuantizedBVHNodeVector<8> qwide8_nodes;
+
+  // Leaf primitives in typed contiguous arrays, so that leaves dispatch on
+  // the type once per run instead of once per primitive.
+  std::vector<TriangleBlock, AlignedAllocator<TriangleBlock, 64> > triangle_blocks;
+  std::vector<LeafSphere> spheres;
+  std::vector<LeafPrimitives> leaf_primitives; ///< per leaf, by leaf ordinal
+  std::vector<LeafStarts> leaf_starts;          ///< leaf ordinal of the first references
+
+  /**
+   * Single ray traversals of the binary nodes starting at the given node.
+   */
+  bool has_intersection_from(uint32_t root, const Ray& r) const;
+  bool intersect_from(uint32_t root, const Ray& r, Intersection* i) const;
+
+  /**
+   * Intersect the leaf references [offset, offset + count): the triangles
+   * a block at a time with the vectorized test, the spheres from the sphere
+   * array and the other primitives through their virtual methods.
+   * Implemented in bvh_leaves.cpp.
+   */
+  bool has_intersection_leaf(uint32_t offset, uint32_t count, const Ray& r) const;
+  bool intersect_leaf(uint32_t offset, uint32_t count, const Ray& r, Intersection* i) const;
+
+  /**
+   * Order the references of every leaf by type and copy the triangles and
+   * spheres into the typed arrays. Implemented in bvh_leaves.cpp.
+   */
+  void build_leaf_primitives();
+
+  /**
+   * Packet traversal of the binary nodes, either for the closest hits or,
+   * if any_hit is set, until every ray has a hit.
+   */
+  template <bool any_hit>
+  uint32_t trace_packet(const Ray* rays, Intersection* isects, size_t n) const;
+
+  /**
+   * Append the subtree rooted at node to the flattened node array.
+   * \return index of the flattened node
+   */
+  uint32_t flatten(const BVHNode *node, size_t depth);
+
+  /**
+   * Append a wide node holding the children found by opening the binary
+   * node with the given index, and recursively the wide nodes of its
+   * interior children. Implemented in bvh_wide.cpp.
+   * \return index of the wide node
+   */
+  template <int N>
+  uint32_t collapse(uint32_t node, WideBVHNodeVector<N>& wide_nodes) const;
+
+  /**
+   * Reorder the wide nodes into treelets of about a page each. A treelet
+   * grows from its root by taking the frontier node with the largest
+   * surface area, which is the one most rays reach next, and the nodes
+   * left on the frontier become the roots of the following treelets.
+   * Rays then touch few pages on their way down instead of a node on a
+   * different page at every level. Implemented in bvh_wide.cpp.
+   */
+  template <int N>
+  static void reorder_treelets(WideBVHNodeVector<N>& wide_nodes);
+
+  /**
+   * Quantize every wide node into the quantized node with the same index.
+   * Implemented in bvh_wide.cpp.
+   */
+  template <int N>
+  static void quantize(const WideBVHNodeVector<N>& wide_nodes,
+                       QuantizedBVHNodeVector<N>& quantized_nodes);
+
+  /**
+   * Collapse the binary nodes into the wide nodes of the layout, if any.
+   */
+  void build_wide_nodes();
+
+  /**
+   * Traverse the wide (WideBVHNode) or quantized (QuantizedBVHNode) nodes,
+   * either for the closest hit or, if any_hit is set, until the first hit.
+   * Implemented in bvh_wide.cpp.
+   */
+  template <typename Node, bool any_hit>
+  bool intersect_wide(const std::vector<Node, AlignedAllocator<Node, 64> >& wide_nodes,
+                      const Ray& r, Intersection* i) const;
+
+  BVHNode *construct_bvh(std::vector<Primitive*>::iterator start, std::vector<Primitive*>::iterator end, size_t max_leaf_size, size_t num_threads, size_t depth);
+
+  /**
+   * Build a linear BVH over all primitives. The primitive centroids are
+   * sorted by Morton code with a parallel radix sort, treelets are emitted
+   * from the sorted code bits and the treelet roots are joined with a SAH
+   * build. Reorders the primitive vector. Implemented in bvh_lbvh.cpp.
+   */
+  BVHNode *construct_lbvh(size_t max_leaf_size, size_t num_threads);
+
+  /**
+   * Build a BVH that considers spatial splits next to the binned SAH object
+   * splits. Primitives straddling a spatial split are referenced from both
+   * children, with their bounds clipped to each side, until the duplication
+   * budget is used up. Replaces the primitive vector with the references in
+   * leaf order. Implemented in bvh_sbvh.cpp.
+   */
+  BVHNode *construct_sbvh(size_t max_leaf_size, double duplication_budget);
+
+  /**
+   * Partition [start, end) using the binned surface area heuristic. The
+   * primitives are reordered in place so that [start, mid) and [mid, end)
+   * are the two children. Binning and partitioning are split into
+   * num_chunks chunks that run on separate threads.
+   * \return the split point, or start if no useful split was found
+   */
+  std::vector<Primitive*>::iterator partition_sah(std::vector<Primitive*>::iterator start,
+                                                   std::vector<Primitive*>::iterator end,
+                                                   size_t num_chunks);
 };
 
+/**
+ * Time the ray - box slab tests on random boxes and rays, including axis
+ * parallel rays, and print the results: the reference test with divisions
+ * and swaps, BBox::intersect (double) and LinearBVHNode::intersect (float).
+ * \param num_tests number of ray - box tests per kernel
+ */
+void benchmark_slab_tests(size_t num_tests);
+
 } // namespace SceneObjects
 } // namespace CGL
 
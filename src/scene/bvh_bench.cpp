@@ -0,0 +1,154 @@
+#include "bvh.h"
+
+#include "CGL/CGL.h"
+#include "CGL/timer.h"
+
+#include <cstdio>
+#include <random>
+
+using namespace std;
+
+namespace CGL {
+namespace SceneObjects {
+
+static const size_t BENCH_NUM_BOXES = 1024;
+static const size_t BENCH_NUM_RAYS = 1024;
+
+/**
+ * Slab test as BBox::intersect used to be written: one division per plane
+ * and a branch to order every slab. Kept as the baseline of the benchmark.
+ */
+static inline bool reference_intersect(const BBox& bb, const Ray& r,
+                                       double& t0, double& t1) {
+  double t_enter = t0, t_exit = t1;
+  for (int a = 0; a < 3; a++) {
+    double t_near = (bb.min[a] - r.o[a]) / r.d[a];
+    double t_far  = (bb.max[a] - r.o[a]) / r.d[a];
+    if (t_near > t_far) swap(t_near, t_far);
+    if (t_near > t_enter) t_enter = t_near;
+    if (t_far < t_exit) t_exit = t_far;
+  }
+  if (t_enter > t_exit) return false;
+  t0 = t_enter;
+  t1 = t_exit;
+  return true;
+}
+
+/**
+ * Result of one kernel over all the ray - box pairs.
+ */
+struct SlabBenchResult {
+  double seconds;
+  size_t hits;
+  double t_sum;   ///< sum of the entry times of the hits, keeps the work alive
+};
+
+template <typename Test>
+static SlabBenchResult run_slab_bench(size_t passes, Test test) {
+  SlabBenchResult result = { 0, 0, 0 };
+  Timer timer;
+  timer.start();
+  for (size_t p = 0; p < passes; p++) {
+    for (size_t r = 0; r < BENCH_NUM_RAYS; r++) {
+      for (size_t b = 0; b < BENCH_NUM_BOXES; b++) {
+        double t_enter;
+        if (test(r, b, &t_enter)) {
+          result.hits++;
+          result.t_sum += t_enter;
+        }
+      }
+    }
+  }
+  timer.stop();
+  result.seconds = timer.duration();
+  return result;
+}
+
+void benchmark_slab_tests(size_t num_tests) {
+  mt19937 rng(1);
+  uniform_real_distribution<double> uniform(-1, 1);
+
+  vector<BBox> boxes;
+  vector<LinearBVHNode> nodes(BENCH_NUM_BOXES);
+  for (size_t b = 0; b < BENCH_NUM_BOXES; b++) {
+    Vector3D c(uniform(rng), uniform(rng), uniform(rng));
+    Vector3D e(0.25 * (uniform(rng) + 1), 0.25 * (uniform(rng) + 1),
+               0.25 * (uniform(rng) + 1));
+    boxes.push_back(BBox(c - e, c + e));
+    nodes[b].set_bbox(boxes.back());
+  }
+
+  // every fourth ray is parallel to one or two axes, some of them starting
+  // on a slab plane, to exercise the inf and NaN cases
+  vector<Ray> rays;
+  for (size_t r = 0; r < BENCH_NUM_RAYS; r++) {
+    Vector3D o(2 * uniform(rng), 2 * uniform(rng), 2 * uniform(rng));
+    Vector3D d(uniform(rng), uniform(rng), uniform(rng));
+    if (r % 4 == 0) {
+      d[r / 4 % 3] = 0;
+      if (r % 8 == 0) d[(r / 4 + 1) % 3] = 0;
+      if (r % 16 == 0) o[r / 4 % 3] = boxes[r % BENCH_NUM_BOXES].min[r / 4 % 3];
+    }
+    rays.push_back(Ray(o, d.unit(), 10.0));
+  }
+
+  vector<float> o(3 * BENCH_NUM_RAYS), inv_d(3 * BENCH_NUM_RAYS);
+  for (size_t r = 0; r < BENCH_NUM_RAYS; r++) {
+    for (int a = 0; a < 3; a++) {
+      o[3 * r + a] = (float)rays[r].o[a];
+      inv_d[3 * r + a] = (float)rays[r].inv_d[a];
+    }
+  }
+
+  size_t passes = max<size_t>(1, num_tests / (BENCH_NUM_BOXES * BENCH_NUM_RAYS));
+  size_t total = passes * BENCH_NUM_BOXES * BENCH_NUM_RAYS;
+
+  SlabBenchResult reference = run_slab_bench(passes, [&](size_t r, size_t b, double* t) {
+    double t0 = rays[r].min_t, t1 = rays[r].max_t;
+    bool hit = reference_intersect(boxes[b], rays[r], t0, t1);
+    *t = t0;
+    return hit;
+  });
+  SlabBenchResult bbox = run_slab_bench(passes, [&](size_t r, size_t b, double* t) {
+    double t0 = rays[r].min_t, t1 = rays[r].max_t;
+    bool hit = boxes[b].intersect(rays[r], t0, t1);
+    *t = t0;
+    return hit;
+  });
+  SlabBenchResult node = run_slab_bench(passes, [&](size_t r, size_t b, double* t) {
+    float t0 = rays[r].min_t, t1 = rays[r].max_t;
+    bool hit = nodes[b].intersect(&o[3 * r], &inv_d[3 * r], rays[r].sign, t0, t1);
+    *t = t0;
+    return hit;
+  });
+
+  // the new tests are conservative and differ from the reference only on
+  // grazing rays, and where it divides 0 by 0
+  size_t mismatches = 0;
+  for (size_t r = 0; r < BENCH_NUM_RAYS; r++) {
+    for (size_t b = 0; b < BENCH_NUM_BOXES; b++) {
+      double t0 = rays[r].min_t, t1 = rays[r].max_t;
+      double u0 = t0, u1 = t1;
+      if (reference_intersect(boxes[b], rays[r], t0, t1) !=
+          boxes[b].intersect(rays[r], u0, u1)) {
+        mismatches++;
+      }
+    }
+  }
+
+  fprintf(stdout, "[PathTracer] Slab tests, %lu ray - box pairs per kernel\n", total);
+  fprintf(stdout, "%-22s %10s %8s %10s\n", "kernel", "ns/test", "speedup", "hits");
+  const char* names[] = { "reference (double)", "BBox (double)", "LinearBVHNode (float)" };
+  const SlabBenchResult* results[] = { &reference, &bbox, &node };
+  for (int k = 0; k < 3; k++) {
+    fprintf(stdout, "%-22s %10.3f %8.2f %10lu\n", names[k],
+            results[k]->seconds * 1e9 / total, reference.seconds / results[k]->seconds,
+            results[k]->hits);
+  }
+  fprintf(stdout, "BBox vs reference mismatches: %lu of %lu (checksum %g)\n",
+          mismatches, BENCH_NUM_BOXES * BENCH_NUM_RAYS,
+          reference.t_sum + bbox.t_sum + node.t_sum);
+}
+
+} // namespace SceneObjects
+} // namespace CGL
@@ -0,0 +1,240 @@
+#include "bvh.h"
+
+#include <cstdio>
+#include <algorithm>
+#include <cstring>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace CGL {
+namespace SceneObjects {
+
+// Bumped whenever the file layout or the node layout changes.
+static const uint32_t BVH_CACHE_VERSION = 1;
+
+static const char BVH_CACHE_MAGIC[8] = { 'C', 'G', 'L', 'B', 'V', 'H', 0, 0 };
+
+/**
+ * Header of a BVH cache file. It is followed by the flattened nodes and by
+ * the input index of every leaf reference (uint32_t each).
+ */
+struct BVHCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t node_size;             ///< sizeof(LinearBVHNode) of the writer
+  uint64_t key;                   ///< cache key of primitives and settings
+  uint64_t num_nodes;
+  uint64_t num_references;        ///< number of leaf references
+  uint64_t num_input_primitives;
+  uint32_t method;                ///< build method the tree was made with
+  uint32_t padding;
+  double bounds[6];               ///< exact bounds, min then max
+};
+
+/**
+ * Read only view of a whole file, memory mapped where available.
+ */
+class CacheFile {
+ public:
+  CacheFile() : data(NULL), size(0) { }
+
+  ~CacheFile() {
+#ifndef _WIN32
+    if (data) munmap((void *)data, size);
+#endif
+  }
+
+  bool open(const string &path) {
+#ifdef _WIN32
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) return false;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (length <= 0) {
+      fclose(file);
+      return false;
+    }
+    buffer.resize(length);
+    bool ok = fread(buffer.data(), 1, length, file) == (size_t)length;
+    fclose(file);
+    if (!ok) return false;
+    data = buffer.data();
+    size = buffer.size();
+    return true;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+      close(fd);
+      return false;
+    }
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return false;
+    data = (const char *)mapping;
+    size = st.st_size;
+    return true;
+#endif
+  }
+
+  const char *data;
+  size_t size;
+
+ private:
+#ifdef _WIN32
+  vector<char> buffer;
+#endif
+};
+
+uint64_t BVHAccel::cache_key(const std::vector<Primitive *> &primitives,
+                             size_t max_leaf_size, BVHBuildMethod method,
+                             double duplication_budget) {
+  // FNV-1a over 64 bit words
+  uint64_t hash = 14695981039346656037ull;
+  auto mix = [&hash](uint64_t value) { hash = (hash ^ value) * 1099511628211ull; };
+  auto mix_double = [&mix](double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    mix(bits);
+  };
+
+  mix(BVH_CACHE_VERSION);
+  mix(max_leaf_size);
+  mix(method);
+  mix_double(duplication_budget);
+  mix(primitives.size());
+  for (const Primitive *p : primitives) {
+    BBox bb = p->get_bbox();
+    for (int a = 0; a < 3; a++) {
+      mix_double(bb.min[a]);
+      mix_double(bb.max[a]);
+    }
+  }
+  return hash;
+}
+
+bool BVHAccel::save(const std::string &path, uint64_t key) const {
+  BVHCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic));
+  header.version = BVH_CACHE_VERSION;
+  header.node_size = sizeof(LinearBVHNode);
+  header.key = key;
+  header.num_nodes = nodes.size();
+  header.num_references = input_indices.size();
+  header.num_input_primitives = num_input_primitives;
+  header.method = method;
+  for (int a = 0; a < 3; a++) {
+    header.bounds[a] = bb.min[a];
+    header.bounds[3 + a] = bb.max[a];
+  }
+
+#ifdef _WIN32
+  string tmp_path = path + ".tmp" + to_string(_getpid());
+#else
+  string tmp_path = path + ".tmp" + to_string(getpid());
+#endif
+  FILE *file = fopen(tmp_path.c_str(), "wb");
+  if (!file) return false;
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  if (ok && !nodes.empty()) {
+    ok = fwrite(nodes.data(), sizeof(LinearBVHNode), nodes.size(), file) == nodes.size();
+  }
+  if (ok && !input_indices.empty()) {
+    ok = fwrite(input_indices.data(), sizeof(uint32_t), input_indices.size(), file) ==
+         input_indices.size();
+  }
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    remove(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+BVHAccel *BVHAccel::load(const std::string &path, uint64_t key,
+                         const std::vector<Primitive *> &primitives,
+                         BVHLayout layout, bool treelets) {
+  CacheFile file;
+  if (!file.open(path) || file.size < sizeof(BVHCacheHeader)) return NULL;
+
+  BVHCacheHeader header;
+  memcpy(&header, file.data, sizeof(header));
+  if (memcmp(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != BVH_CACHE_VERSION ||
+      header.node_size != sizeof(LinearBVHNode) || header.key != key ||
+      header.num_input_primitives != primitives.size() ||
+      header.num_nodes == 0) {
+    return NULL;
+  }
+  uint64_t expected_size = sizeof(header) +
+                           header.num_nodes * sizeof(LinearBVHNode) +
+                           header.num_references * sizeof(uint32_t);
+  if (file.size != expected_size) return NULL;
+
+  BVHAccel *bvh = new BVHAccel();
+  bvh->total_rays = 0;
+  bvh->total_isects = 0;
+  bvh->method = (BVHBuildMethod)header.method;
+  bvh->layout = layout;
+  bvh->treelets = treelets;
+  bvh->num_input_primitives = primitives.size();
+  bvh->bb = BBox(header.bounds[0], header.bounds[1], header.bounds[2],
+                 header.bounds[3], header.bounds[4], header.bounds[5]);
+
+  // the file is only aligned to the header, so copy rather than alias
+  const char *data = file.data + sizeof(header);
+  bvh->nodes.resize(header.num_nodes);
+  memcpy(bvh->nodes.data(), data, header.num_nodes * sizeof(LinearBVHNode));
+  data += header.num_nodes * sizeof(LinearBVHNode);
+  bvh->input_indices.resize(header.num_references);
+  memcpy(bvh->input_indices.data(), data, header.num_references * sizeof(uint32_t));
+
+  // reject damaged files instead of crashing while tracing them
+  bool ok = true;
+  bvh->primitives.resize(header.num_references);
+  for (size_t k = 0; k < bvh->input_indices.size() && ok; k++) {
+    ok = bvh->input_indices[k] < primitives.size();
+    if (ok) bvh->primitives[k] = primitives[bvh->input_indices[k]];
+  }
+  // children come after their parent, so the depths are known in order;
+  // traversals use fixed size stacks, so the depth is capped as in the build
+  vector<uint32_t> depths(bvh->nodes.size(), 0);
+  for (size_t n = 0; n < bvh->nodes.size() && ok; n++) {
+    const LinearBVHNode &node = bvh->nodes[n];
+    if (node.isLeaf()) {
+      ok = (uint64_t)node.primitives_offset + node.n_primitives <= header.num_references;
+    } else {
+      ok = n + 1 < bvh->nodes.size() && node.second_child_offset > n + 1 &&
+           node.second_child_offset < bvh->nodes.size() &&
+           depths[n] + 1 < BVH_STACK_SIZE;
+      if (ok) {
+        depths[n + 1] = max(depths[n + 1], depths[n] + 1);
+        depths[node.second_child_offset] =
+            max(depths[node.second_child_offset], depths[n] + 1);
+      }
+    }
+  }
+  if (!ok) {
+    delete bvh;
+    return NULL;
+  }
+
+  bvh->build_wide_nodes();
+  bvh->build_leaf_primitives();
+  return bvh;
+}
+
+} // namespace SceneObjects
+} // namespace CGL
@@ -0,0 +1,350 @@
+#include "bvh.h"
+
+#include "util/parallel.h"
+
+#include <algorithm>
+#include <cstdint>
+
+using namespace std;
+
+namespace CGL {
+namespace SceneObjects {
+
+// Number of high Morton bits that group primitives into treelets. Treelets
+// are built independently from the remaining bits and then joined by a SAH
+// build over their roots.
+static const int LBVH_TREELET_BITS = 12;
+
+// Scenes with more primitives than this use 63-bit instead of 30-bit codes
+// so that nearby primitives still get distinct codes.
+static const size_t LBVH_WIDE_CODE_THRESHOLD = 1 << 20;
+
+// Number of buckets used by the SAH build over the treelet roots.
+static const int LBVH_SAH_BUCKETS = 16;
+
+// Levels of the SAH build over the treelet roots deeper than this are split
+// at the median, bounding the depth of the final tree.
+static const size_t LBVH_SAH_MAX_DEPTH = 24;
+
+struct MortonPrimitive {
+  uint64_t code;    ///< Morton code of the primitive centroid
+  uint32_t index;   ///< index of the primitive in the input vector
+};
+
+// Spread the low 10 bits of x so there are two zero bits between each.
+static inline uint64_t expand_bits_10(uint64_t x) {
+  x &= 0x3ff;
+  x = (x | (x << 16)) & 0x30000ff;
+  x = (x | (x <<  8)) & 0x300f00f;
+  x = (x | (x <<  4)) & 0x30c30c3;
+  x = (x | (x <<  2)) & 0x9249249;
+  return x;
+}
+
+// Spread the low 21 bits of x so there are two zero bits between each.
+static inline uint64_t expand_bits_21(uint64_t x) {
+  x &= 0x1fffff;
+  x = (x | (x << 32)) & 0x1f00000000ffffull;
+  x = (x | (x << 16)) & 0x1f0000ff0000ffull;
+  x = (x | (x <<  8)) & 0x100f00f00f00f00full;
+  x = (x | (x <<  4)) & 0x10c30c30c30c30c3ull;
+  x = (x | (x <<  2)) & 0x1249249249249249ull;
+  return x;
+}
+
+/**
+ * Sort the Morton primitives by code with a least significant digit radix
+ * sort. Every pass histograms the chunks in parallel, turns the histograms
+ * into per-chunk scatter offsets and scatters the chunks in parallel.
+ */
+static void radix_sort(vector<MortonPrimitive>& prims, int code_bits,
+                       size_t num_threads) {
+  const int digit_bits = 8;
+  const int num_digits = 1 << digit_bits;
+  const uint64_t digit_mask = num_digits - 1;
+
+  size_t count = prims.size();
+  size_t num_chunks = max<size_t>(1, min(num_threads, count / 4096));
+
+  vector<MortonPrimitive> scratch(count);
+  vector<size_t> offsets(num_chunks * num_digits);
+
+  for (int shift = 0; shift < code_bits; shift += digit_bits) {
+    fill(offsets.begin(), offsets.end(), 0);
+    parallel_for(0, count, num_chunks, [&](size_t chunk, size_t b, size_t e) {
+      size_t *histogram = &offsets[chunk * num_digits];
+      for (size_t i = b; i < e; i++) {
+        histogram[(prims[i].code >> shift) & digit_mask]++;
+      }
+    });
+
+    // digit-major, chunk-minor prefix sum keeps the sort stable
+    size_t sum = 0;
+    for (int d = 0; d < num_digits; d++) {
+      for (size_t chunk = 0; chunk < num_chunks; chunk++) {
+        size_t n = offsets[chunk * num_digits + d];
+        offsets[chunk * num_digits + d] = sum;
+        sum += n;
+      }
+    }
+
+    parallel_for(0, count, num_chunks, [&](size_t chunk, size_t b, size_t e) {
+      size_t *offset = &offsets[chunk * num_digits];
+      for (size_t i = b; i < e; i++) {
+        scratch[offset[(prims[i].code >> shift) & digit_mask]++] = prims[i];
+      }
+    });
+
+    prims.swap(scratch);
+  }
+}
+
+/**
+ * Emit the hierarchy for the sorted range [start, end) by splitting it where
+ * the Morton code bit at bit_index changes, moving on to lower bits when all
+ * codes in the range agree.
+ */
+static BVHNode *emit_lbvh(vector<Primitive *>::iterator prims,
+                          const MortonPrimitive *codes, size_t start,
+                          size_t end, int bit_index, size_t max_leaf_size) {
+  size_t count = end - start;
+
+  if (count <= max_leaf_size || bit_index < 0) {
+    size_t mid = start + count / 2;
+    if (count > max_leaf_size) {
+      // identical codes, split in the middle to respect the leaf size
+      BVHNode *l = emit_lbvh(prims, codes, start, mid, -1, max_leaf_size);
+      BVHNode *r = emit_lbvh(prims, codes, mid, end, -1, max_leaf_size);
+      BBox bbox = l->bb;
+      bbox.expand(r->bb);
+      BVHNode *node = new BVHNode(bbox);
+      node->l = l;
+      node->r = r;
+      return node;
+    }
+
+    BBox bbox;
+    for (size_t i = start; i < end; i++) {
+      bbox.expand(prims[i]->get_bbox());
+    }
+    BVHNode *node = new BVHNode(bbox);
+    node->start = prims + start;
+    node->end = prims + end;
+    return node;
+  }
+
+  uint64_t mask = 1ull << bit_index;
+  if ((codes[start].code & mask) == (codes[end - 1].code & mask)) {
+    return emit_lbvh(prims, codes, start, end, bit_index - 1, max_leaf_size);
+  }
+
+  // binary search for the first code with the bit set
+  size_t lo = start, hi = end - 1;
+  while (lo + 1 < hi) {
+    size_t m = (lo + hi) / 2;
+    if (codes[m].code & mask) {
+      hi = m;
+    } else {
+      lo = m;
+    }
+  }
+  size_t split = hi;
+
+  BVHNode *l = emit_lbvh(prims, codes, start, split, bit_index - 1, max_leaf_size);
+  BVHNode *r = emit_lbvh(prims, codes, split, end, bit_index - 1, max_leaf_size);
+  BBox bbox = l->bb;
+  bbox.expand(r->bb);
+  BVHNode *node = new BVHNode(bbox);
+  node->l = l;
+  node->r = r;
+  return node;
+}
+
+/**
+ * Join the treelet roots in [start, end) with a binned SAH build over their
+ * bounding boxes.
+ */
+static BVHNode *build_upper_sah(vector<BVHNode *>::iterator start,
+                                vector<BVHNode *>::iterator end,
+                                size_t depth) {
+  size_t count = end - start;
+  if (count == 1) {
+    return *start;
+  }
+
+  BBox bbox, centroid_box;
+  for (auto n = start; n != end; n++) {
+    bbox.expand((*n)->bb);
+    centroid_box.expand((*n)->bb.centroid());
+  }
+
+  int axis = 0;
+  if (centroid_box.extent.y > centroid_box.extent[axis]) axis = 1;
+  if (centroid_box.extent.z > centroid_box.extent[axis]) axis = 2;
+
+  auto mid = start + count / 2;
+  double axis_min = centroid_box.min[axis];
+  double axis_extent = centroid_box.extent[axis];
+  if (axis_extent > 0 && depth < LBVH_SAH_MAX_DEPTH) {
+    auto bucket_index = [&](const BVHNode *n) {
+      int b = (int)(LBVH_SAH_BUCKETS *
+                    (n->bb.centroid()[axis] - axis_min) / axis_extent);
+      return min(max(b, 0), LBVH_SAH_BUCKETS - 1);
+    };
+
+    size_t bucket_count[LBVH_SAH_BUCKETS] = {0};
+    BBox bucket_bb[LBVH_SAH_BUCKETS];
+    for (auto n = start; n != end; n++) {
+      int b = bucket_index(*n);
+      bucket_count[b]++;
+      bucket_bb[b].expand((*n)->bb);
+    }
+
+    int best_split = -1;
+    double best_cost = INF_D;
+    for (int i = 0; i < LBVH_SAH_BUCKETS - 1; i++) {
+      BBox l, r;
+      size_t nl = 0, nr = 0;
+      for (int j = 0; j <= i; j++) {
+        l.expand(bucket_bb[j]);
+        nl += bucket_count[j];
+      }
+      for (int j = i + 1; j < LBVH_SAH_BUCKETS; j++) {
+        r.expand(bucket_bb[j]);
+        nr += bucket_count[j];
+      }
+      if (nl == 0 || nr == 0) continue;
+      double cost = nl * l.surface_area() + nr * r.surface_area();
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_split = i;
+      }
+    }
+
+    if (best_split >= 0) {
+      mid = partition(start, end, [&](const BVHNode *n) {
+        return bucket_index(n) <= best_split;
+      });
+    }
+  }
+
+  BVHNode *node = new BVHNode(bbox);
+  node->l = build_upper_sah(start, mid, depth + 1);
+  node->r = build_upper_sah(mid, end, depth + 1);
+  return node;
+}
+
+/**
+ * Copy the leaf primitives of the subtree into ordered in depth-first order
+ * and point every node of the subtree at its range in ordered.
+ */
+static void relink(BVHNode *node, vector<Primitive *>& ordered) {
+  if (node->isLeaf()) {
+    size_t offset = ordered.size();
+    ordered.insert(ordered.end(), node->start, node->end);
+    node->start = ordered.begin() + offset;
+    node->end = ordered.end();
+    return;
+  }
+  relink(node->l, ordered);
+  relink(node->r, ordered);
+  node->start = node->l->start;
+  node->end = node->r->end;
+}
+
+BVHNode *BVHAccel::construct_lbvh(size_t max_leaf_size, size_t num_threads) {
+
+  size_t primitive_count = primitives.size();
+  if (primitive_count == 0) {
+    BVHNode *node = new BVHNode(BBox());
+    node->start = primitives.begin();
+    node->end = primitives.end();
+    return node;
+  }
+
+  size_t num_chunks = primitive_count >= 4096 ? num_threads : 1;
+
+  // bounds of the primitive centroids, used to quantize the centroids
+  vector<BBox> chunk_centroid_box(num_chunks);
+  parallel_for(0, primitive_count, num_chunks,
+               [&](size_t chunk, size_t b, size_t e) {
+    for (size_t i = b; i < e; i++) {
+      chunk_centroid_box[chunk].expand(primitives[i]->get_bbox().centroid());
+    }
+  });
+
+  BBox centroid_box;
+  for (const BBox &bb : chunk_centroid_box) {
+    centroid_box.expand(bb);
+  }
+
+  int code_bits = primitive_count > LBVH_WIDE_CODE_THRESHOLD ? 63 : 30;
+  double scale = code_bits == 63 ? (1 << 21) - 1 : (1 << 10) - 1;
+
+  vector<MortonPrimitive> codes(primitive_count);
+  parallel_for(0, primitive_count, num_chunks,
+               [&](size_t /*chunk*/, size_t b, size_t e) {
+    for (size_t i = b; i < e; i++) {
+      Vector3D c = primitives[i]->get_bbox().centroid() - centroid_box.min;
+      uint64_t q[3];
+      for (int axis = 0; axis < 3; axis++) {
+        double extent = centroid_box.extent[axis];
+        q[axis] = extent > 0 ? (uint64_t)(c[axis] / extent * scale) : 0;
+      }
+      codes[i].index = (uint32_t)i;
+      codes[i].code = code_bits == 63
+          ? (expand_bits_21(q[0]) << 2) | (expand_bits_21(q[1]) << 1) | expand_bits_21(q[2])
+          : (expand_bits_10(q[0]) << 2) | (expand_bits_10(q[1]) << 1) | expand_bits_10(q[2]);
+    }
+  });
+
+  radix_sort(codes, code_bits, num_threads);
+
+  vector<Primitive *> sorted(primitive_count);
+  for (size_t i = 0; i < primitive_count; i++) {
+    sorted[i] = primitives[codes[i].index];
+  }
+  primitives.swap(sorted);
+
+  // group the sorted primitives into treelets that share the high bits
+  int treelet_shift = code_bits - LBVH_TREELET_BITS;
+  vector<size_t> treelet_starts;
+  treelet_starts.push_back(0);
+  for (size_t i = 1; i < primitive_count; i++) {
+    if ((codes[i].code >> treelet_shift) !=
+        (codes[i - 1].code >> treelet_shift)) {
+      treelet_starts.push_back(i);
+    }
+  }
+  size_t num_treelets = treelet_starts.size();
+  treelet_starts.push_back(primitive_count);
+
+  // build the treelets in parallel, each chunk taking the treelets that
+  // start inside its share of the primitives
+  vector<BVHNode *> treelets(num_treelets);
+  parallel_for(0, primitive_count, num_chunks,
+               [&](size_t /*chunk*/, size_t b, size_t e) {
+    auto first = lower_bound(treelet_starts.begin(),
+                             treelet_starts.begin() + num_treelets, b);
+    for (auto t = first; t != treelet_starts.begin() + num_treelets && *t < e; t++) {
+      size_t i = t - treelet_starts.begin();
+      treelets[i] = emit_lbvh(primitives.begin(), &codes[0], treelet_starts[i],
+                              treelet_starts[i + 1], treelet_shift - 1,
+                              max_leaf_size);
+    }
+  });
+
+  // refine the top levels with a SAH build over the treelet roots and lay
+  // the primitives out in the final depth-first order
+  BVHNode *node = build_upper_sah(treelets.begin(), treelets.end(), 0);
+
+  vector<Primitive *> ordered;
+  ordered.reserve(primitive_count);
+  relink(node, ordered);
+  primitives.swap(ordered);
+
+  return node;
+}
+
+} // namespace SceneObjects
+} // namespace CGL
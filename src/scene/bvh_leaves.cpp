@@ -0,0 +1,307 @@
+#include "bvh.h"
+
+#include "CGL/CGL.h"
+#include "sphere.h"
+#include "triangle.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BVH_LEAVES_SSE
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+using namespace std;
+
+namespace CGL {
+namespace SceneObjects {
+
+static_assert(BVH_TRIANGLE_BLOCK_SIZE == 4, "triangle blocks are tested with 4 wide SSE");
+
+/**
+ * Ray - triangle intersection for the lanes of a block in lane_mask, the
+ * watertight test of intersect_watertight with 4 lanes at a time. Lanes
+ * where the ray passes exactly through an edge or vertex are redone by
+ * intersect_watertight, which decides them in double precision.
+ * \param t time of intersection of every lane
+ * \param bar1 barycentric coordinate of the second vertex of every lane
+ * \param bar2 barycentric coordinate of the third vertex of every lane
+ * \return bit mask of the lanes hit within [r.min_t, r.max_t]
+ */
+static inline int intersect_block(const TriangleBlock& b, const Ray& r, int lane_mask,
+                                  float* t, float* bar1, float* bar2) {
+#ifdef BVH_LEAVES_SSE
+  const int kx = r.kx, ky = r.ky, kz = r.kz;
+  const __m128 o_x = _mm_set1_ps((float)r.o[kx]);
+  const __m128 o_y = _mm_set1_ps((float)r.o[ky]);
+  const __m128 o_z = _mm_set1_ps((float)r.o[kz]);
+  const __m128 s_x = _mm_set1_ps(r.shear[0]);
+  const __m128 s_y = _mm_set1_ps(r.shear[1]);
+  const __m128 s_z = _mm_set1_ps(r.shear[2]);
+
+  // vertices relative to the ray origin, sheared so that the ray runs
+  // along the kz axis
+  __m128 x[3], y[3], z[3];
+  for (int j = 0; j < 3; j++) {
+    __m128 a_x = _mm_sub_ps(_mm_load_ps(b.p[j][kx]), o_x);
+    __m128 a_y = _mm_sub_ps(_mm_load_ps(b.p[j][ky]), o_y);
+    __m128 a_z = _mm_sub_ps(_mm_load_ps(b.p[j][kz]), o_z);
+    x[j] = _mm_sub_ps(a_x, _mm_mul_ps(s_x, a_z));
+    y[j] = _mm_sub_ps(a_y, _mm_mul_ps(s_y, a_z));
+    z[j] = _mm_mul_ps(s_z, a_z);
+  }
+
+  // edge functions
+  __m128 u = _mm_sub_ps(_mm_mul_ps(x[2], y[1]), _mm_mul_ps(y[2], x[1]));
+  __m128 v = _mm_sub_ps(_mm_mul_ps(x[0], y[2]), _mm_mul_ps(y[0], x[2]));
+  __m128 w = _mm_sub_ps(_mm_mul_ps(x[1], y[0]), _mm_mul_ps(y[1], x[0]));
+
+  const __m128 zero = _mm_setzero_ps();
+  __m128 on_edge = _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(u, zero), _mm_cmpeq_ps(v, zero)),
+                             _mm_cmpeq_ps(w, zero));
+  __m128 neg = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmplt_ps(v, zero)),
+                         _mm_cmplt_ps(w, zero));
+  __m128 pos = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmpgt_ps(v, zero)),
+                         _mm_cmpgt_ps(w, zero));
+  __m128 det = _mm_add_ps(_mm_add_ps(u, v), w);
+  __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+  __m128 tt = _mm_add_ps(_mm_add_ps(_mm_mul_ps(u, z[0]), _mm_mul_ps(v, z[1])),
+                         _mm_mul_ps(w, z[2]));
+  tt = _mm_mul_ps(tt, inv_det);
+
+  __m128 hit = _mm_andnot_ps(_mm_and_ps(neg, pos), _mm_cmpneq_ps(det, zero));
+  hit = _mm_and_ps(hit, _mm_cmpge_ps(tt, _mm_set1_ps((float)r.min_t)));
+  hit = _mm_and_ps(hit, _mm_cmple_ps(tt, _mm_set1_ps((float)r.max_t)));
+  _mm_storeu_ps(t, tt);
+  _mm_storeu_ps(bar1, _mm_mul_ps(v, inv_det));
+  _mm_storeu_ps(bar2, _mm_mul_ps(w, inv_det));
+  int mask = _mm_movemask_ps(hit) & lane_mask;
+
+  // the segment was rounded to float, which can only let more hits through;
+  // compare those in double as intersect_watertight does
+  for (int k = 0, m = mask; m; k++, m >>= 1) {
+    if ((m & 1) && !(t[k] >= r.min_t && t[k] <= r.max_t)) mask &= ~(1 << k);
+  }
+
+  // rays through an edge are rare, finish those lanes one by one
+  int redo = _mm_movemask_ps(on_edge) & lane_mask;
+  for (int k = 0; redo; k++, redo >>= 1) {
+    if (!(redo & 1)) continue;
+    mask &= ~(1 << k);
+    float p[3][3];
+    for (int j = 0; j < 3; j++) {
+      for (int a = 0; a < 3; a++) p[j][a] = b.p[j][a][k];
+    }
+    if (intersect_watertight(p, r, t[k], bar1[k], bar2[k])) mask |= 1 << k;
+  }
+  return mask;
+#else
+  int mask = 0;
+  for (int k = 0; k < BVH_TRIANGLE_BLOCK_SIZE; k++) {
+    if (!((lane_mask >> k) & 1)) continue;
+    float p[3][3];
+    for (int j = 0; j < 3; j++) {
+      for (int a = 0; a < 3; a++) p[j][a] = b.p[j][a][k];
+    }
+    if (intersect_watertight(p, r, t[k], bar1[k], bar2[k])) mask |= 1 << k;
+  }
+  return mask;
+#endif
+}
+
+/**
+ * Mask of the used lanes of block b of a leaf with num_triangles triangles.
+ */
+static inline int block_lanes(uint32_t b, uint32_t num_triangles) {
+  uint32_t n = num_triangles - b * BVH_TRIANGLE_BLOCK_SIZE;
+  return n >= BVH_TRIANGLE_BLOCK_SIZE ? (1 << BVH_TRIANGLE_BLOCK_SIZE) - 1 : (1 << n) - 1;
+}
+
+static inline uint32_t popcount(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return (uint32_t)__builtin_popcountll(x);
+#elif defined(_MSC_VER) && defined(_M_X64)
+  return (uint32_t)__popcnt64(x);
+#else
+  uint32_t n = 0;
+  for (; x; x &= x - 1) n++;
+  return n;
+#endif
+}
+
+/**
+ * Leaf ordinal of the first reference of a leaf, the number of leaves
+ * starting before it.
+ */
+static inline uint32_t leaf_ordinal(const vector<LeafStarts> &starts, uint32_t offset) {
+  const LeafStarts &w = starts[offset >> 6];
+  return w.rank + popcount(w.bits & ((uint64_t(1) << (offset & 63)) - 1));
+}
+
+/**
+ * Primitive types with a typed leaf array, in leaf order.
+ */
+enum LeafPrimitiveType { LEAF_TRIANGLE, LEAF_SPHERE, LEAF_OTHER };
+
+static inline LeafPrimitiveType leaf_primitive_type(const Primitive *p) {
+  if (dynamic_cast<const Triangle *>(p)) return LEAF_TRIANGLE;
+  if (dynamic_cast<const Sphere *>(p)) return LEAF_SPHERE;
+  return LEAF_OTHER;
+}
+
+void BVHAccel::build_leaf_primitives() {
+  triangle_blocks.clear();
+  spheres.clear();
+
+  // mark the leaf starts first, the leaves need not be in reference order
+  leaf_starts.assign((primitives.size() + 63) / 64, LeafStarts());
+  for (const LinearBVHNode &node : nodes) {
+    if (!node.isLeaf() || node.n_primitives == 0) continue;
+    uint32_t begin = node.primitives_offset;
+    leaf_starts[begin >> 6].bits |= uint64_t(1) << (begin & 63);
+  }
+  uint32_t num_leaves = 0;
+  for (LeafStarts &w : leaf_starts) {
+    w.rank = num_leaves;
+    num_leaves += popcount(w.bits);
+  }
+  leaf_primitives.assign(num_leaves, LeafPrimitives());
+
+  vector<pair<LeafPrimitiveType, uint32_t> > order;
+  vector<Primitive *> leaf_refs;
+  vector<uint32_t> leaf_indices;
+  for (const LinearBVHNode &node : nodes) {
+    if (!node.isLeaf() || node.n_primitives == 0) continue;
+    uint32_t begin = node.primitives_offset, count = node.n_primitives;
+
+    // order the references by type, moving their input indices with them
+    // so that refit keeps working
+    order.clear();
+    for (uint32_t k = 0; k < count; k++) {
+      order.push_back(make_pair(leaf_primitive_type(primitives[begin + k]), k));
+    }
+    stable_sort(order.begin(), order.end());
+    leaf_refs.assign(primitives.begin() + begin, primitives.begin() + begin + count);
+    if (!input_indices.empty()) {
+      leaf_indices.assign(input_indices.begin() + begin,
+                          input_indices.begin() + begin + count);
+    }
+    uint32_t num_triangles = 0, num_spheres = 0;
+    for (uint32_t k = 0; k < count; k++) {
+      primitives[begin + k] = leaf_refs[order[k].second];
+      if (!input_indices.empty()) input_indices[begin + k] = leaf_indices[order[k].second];
+      if (order[k].first == LEAF_TRIANGLE) num_triangles++;
+      if (order[k].first == LEAF_SPHERE) num_spheres++;
+    }
+
+    // the runs are at most the leaf, whose size is 16 bits in the nodes
+    assert(num_triangles <= UINT16_MAX && num_spheres <= UINT16_MAX);
+    LeafPrimitives &leaf = leaf_primitives[leaf_ordinal(leaf_starts, begin)];
+    leaf.first_block = (uint32_t)triangle_blocks.size();
+    leaf.first_sphere = (uint32_t)spheres.size();
+    leaf.num_triangles = (uint16_t)num_triangles;
+    leaf.num_spheres = (uint16_t)num_spheres;
+
+    for (uint32_t k = 0; k < num_triangles; k += BVH_TRIANGLE_BLOCK_SIZE) {
+      TriangleBlock block;
+      memset(&block, 0, sizeof(block));
+      for (uint32_t l = 0; l < BVH_TRIANGLE_BLOCK_SIZE && k + l < num_triangles; l++) {
+        const Triangle *tri = static_cast<const Triangle *>(primitives[begin + k + l]);
+        float p[3][3];
+        tri->get_vertices(p);
+        for (int j = 0; j < 3; j++) {
+          for (int a = 0; a < 3; a++) block.p[j][a][l] = p[j][a];
+        }
+      }
+      triangle_blocks.push_back(block);
+    }
+    for (uint32_t k = 0; k < num_spheres; k++) {
+      const Sphere *sphere = static_cast<const Sphere *>(primitives[begin + num_triangles + k]);
+      LeafSphere s;
+      s.o = sphere->o;
+      s.r2 = sphere->r2;
+      spheres.push_back(s);
+    }
+  }
+  triangle_blocks.shrink_to_fit();
+  spheres.shrink_to_fit();
+}
+
+bool BVHAccel::has_intersection_leaf(uint32_t offset, uint32_t count,
+                                     const Ray &r) const {
+  total_isects += count;
+  if (count == 0) return false;
+  const LeafPrimitives &leaf = leaf_primitives[leaf_ordinal(leaf_starts, offset)];
+  uint32_t num_blocks = (leaf.num_triangles + BVH_TRIANGLE_BLOCK_SIZE - 1) /
+                        BVH_TRIANGLE_BLOCK_SIZE;
+  for (uint32_t b = 0; b < num_blocks; b++) {
+    float t[BVH_TRIANGLE_BLOCK_SIZE], bar1[BVH_TRIANGLE_BLOCK_SIZE],
+          bar2[BVH_TRIANGLE_BLOCK_SIZE];
+    if (intersect_block(triangle_blocks[leaf.first_block + b], r,
+                        block_lanes(b, leaf.num_triangles), t, bar1, bar2))
+      return true;
+  }
+  for (uint32_t k = 0; k < leaf.num_spheres; k++) {
+    const LeafSphere &s = spheres[leaf.first_sphere + k];
+    double t1, t2;
+    if (Sphere::test(s.o, s.r2, r, t1, t2)) return true;
+  }
+  for (uint32_t p = leaf.num_triangles + leaf.num_spheres; p < count; p++) {
+    if (primitives[offset + p]->has_intersection(r)) return true;
+  }
+  return false;
+}
+
+bool BVHAccel::intersect_leaf(uint32_t offset, uint32_t count, const Ray &r,
+                              Intersection *i) const {
+  total_isects += count;
+  if (count == 0) return false;
+  const LeafPrimitives &leaf = leaf_primitives[leaf_ordinal(leaf_starts, offset)];
+  bool hit = false;
+  if (leaf.num_triangles) {
+    uint32_t num_blocks = (leaf.num_triangles + BVH_TRIANGLE_BLOCK_SIZE - 1) /
+                          BVH_TRIANGLE_BLOCK_SIZE;
+    int nearest = -1;
+    float nearest_t = 0, nearest_bar1 = 0, nearest_bar2 = 0;
+    for (uint32_t b = 0; b < num_blocks; b++) {
+      float t[BVH_TRIANGLE_BLOCK_SIZE], bar1[BVH_TRIANGLE_BLOCK_SIZE],
+            bar2[BVH_TRIANGLE_BLOCK_SIZE];
+      int mask = intersect_block(triangle_blocks[leaf.first_block + b], r,
+                                 block_lanes(b, leaf.num_triangles), t, bar1, bar2);
+      for (int k = 0; mask; k++, mask >>= 1) {
+        if (!(mask & 1) || (nearest >= 0 && t[k] > nearest_t)) continue;
+        nearest = b * BVH_TRIANGLE_BLOCK_SIZE + k;
+        nearest_t = t[k];
+        nearest_bar1 = bar1[k];
+        nearest_bar2 = bar2[k];
+      }
+    }
+    if (nearest >= 0) {
+      const Triangle *tri = static_cast<const Triangle *>(primitives[offset + nearest]);
+      tri->set_intersection(r, nearest_t, nearest_bar1, nearest_bar2, i);
+      hit = true;
+    }
+  }
+  for (uint32_t k = 0; k < leaf.num_spheres; k++) {
+    const LeafSphere &s = spheres[leaf.first_sphere + k];
+    double t1, t2;
+    if (!Sphere::test(s.o, s.r2, r, t1, t2)) continue;
+    // the Sphere is only touched to record the hit
+    const Sphere *sphere = static_cast<const Sphere *>(primitives[offset + leaf.num_triangles + k]);
+    sphere->set_intersection(r, t1, t2, i);
+    hit = true;
+  }
+  for (uint32_t p = leaf.num_triangles + leaf.num_spheres; p < count; p++) {
+    if (primitives[offset + p]->intersect(r, i)) hit = true;
+  }
+  return hit;
+}
+
+} // namespace SceneObjects
+} // namespace CGL
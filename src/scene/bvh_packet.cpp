@@ -0,0 +1,256 @@
+#include "bvh.h"
+
+#include "CGL/CGL.h"
+
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BVH_PACKET_SSE
+#endif
+
+using namespace std;
+
+namespace CGL {
+namespace SceneObjects {
+
+static_assert(BVH_PACKET_SIZE % 4 == 0 && BVH_PACKET_SIZE <= 32,
+              "packets are tested in groups of 4 rays and tracked in 32 bit masks");
+
+// Subtrees reached by fewer active rays than this are finished one ray at
+// a time, as the packet tests would mostly compute inactive lanes.
+static const int BVH_PACKET_MIN_ACTIVE = 4;
+
+/**
+ * Structure of arrays copy of a ray packet, and the bounds of its origins
+ * and inverse directions for the interval arithmetic frustum test.
+ */
+struct PacketRays {
+  alignas(16) float o[3][BVH_PACKET_SIZE];      ///< origins
+  alignas(16) float inv_d[3][BVH_PACKET_SIZE];  ///< inverse directions
+  alignas(16) float t_min[BVH_PACKET_SIZE];     ///< segment starts
+  alignas(16) float t_max[BVH_PACKET_SIZE];     ///< segment ends, shrink on hits
+  int neg[3];           ///< 1 if the directions are negative along the axis
+  float o_lo[3], o_hi[3];          ///< bounds of the origins
+  float inv_lo[3], inv_hi[3];      ///< bounds of the inverse directions
+  float t_min_lo, t_max_hi;        ///< bounds of the segments
+  bool frustum;         ///< the bounds are finite and can be used for culling
+};
+
+static inline int count_rays(uint32_t mask) {
+  int n = 0;
+  for (; mask; mask &= mask - 1) n++;
+  return n;
+}
+
+/**
+ * Bounds of the product of two intervals.
+ */
+static inline void interval_product(float a_lo, float a_hi, float b_lo, float b_hi,
+                                    float* lo, float* hi) {
+  float p0 = a_lo * b_lo, p1 = a_lo * b_hi, p2 = a_hi * b_lo, p3 = a_hi * b_hi;
+  *lo = min(min(p0, p1), min(p2, p3));
+  *hi = max(max(p0, p1), max(p2, p3));
+}
+
+/**
+ * Packet frustum - node bounds test. The near and far distances of every
+ * ray of the packet lie within the intervals computed from the bounds of
+ * the origins and inverse directions, so if the intervals do not overlap,
+ * no ray of the packet hits the node.
+ * \return true if no ray of the packet can hit the node
+ */
+static inline bool frustum_misses(const LinearBVHNode& node, const PacketRays& p) {
+  float t_near = p.t_min_lo, t_far = p.t_max_hi;
+  for (int a = 0; a < 3; a++) {
+    float near_plane = p.neg[a] ? node.max[a] : node.min[a];
+    float far_plane  = p.neg[a] ? node.min[a] : node.max[a];
+    float near_lo, near_hi, far_lo, far_hi;
+    interval_product(near_plane - p.o_hi[a], near_plane - p.o_lo[a],
+                     p.inv_lo[a], p.inv_hi[a], &near_lo, &near_hi);
+    interval_product(far_plane - p.o_hi[a], far_plane - p.o_lo[a],
+                     p.inv_lo[a], p.inv_hi[a], &far_lo, &far_hi);
+    t_near = max(t_near, near_lo);
+    t_far = min(t_far, far_hi);
+  }
+  // account for the rounding of the interval and of the per ray tests
+  return t_near - fabs(t_near) * 4 * BVH_FLOAT_GAMMA_3 >
+         t_far + fabs(t_far) * 4 * BVH_FLOAT_GAMMA_3;
+}
+
+/**
+ * Ray - node bounds intersection for the rays of the packet in mask, as in
+ * LinearBVHNode::intersect.
+ * \return bit mask of the rays in mask that overlap the node
+ */
+static inline uint32_t intersect_rays(const LinearBVHNode& node, const PacketRays& p,
+                                      uint32_t mask) {
+  uint32_t hit = 0;
+  for (int g = 0; g < BVH_PACKET_SIZE; g += 4) {
+    if (!((mask >> g) & 0xf)) continue;
+#ifdef BVH_PACKET_SSE
+    const __m128 scale = _mm_set1_ps(1.0f + 2.0f * BVH_FLOAT_GAMMA_3);
+    __m128 tn = _mm_load_ps(p.t_min + g);
+    __m128 tf = _mm_load_ps(p.t_max + g);
+    for (int a = 0; a < 3; a++) {
+      __m128 near_plane = _mm_set1_ps(p.neg[a] ? node.max[a] : node.min[a]);
+      __m128 far_plane  = _mm_set1_ps(p.neg[a] ? node.min[a] : node.max[a]);
+      __m128 o = _mm_load_ps(p.o[a] + g);
+      __m128 inv_d = _mm_load_ps(p.inv_d[a] + g);
+      __m128 n = _mm_mul_ps(_mm_sub_ps(near_plane, o), inv_d);
+      __m128 f = _mm_mul_ps(_mm_sub_ps(far_plane, o), inv_d);
+      tn = _mm_max_ps(n, tn);
+      tf = _mm_min_ps(_mm_mul_ps(f, scale), tf);
+    }
+    hit |= (uint32_t)_mm_movemask_ps(_mm_cmple_ps(tn, tf)) << g;
+#else
+    for (int k = g; k < g + 4; k++) {
+      float tn = p.t_min[k], tf = p.t_max[k];
+      for (int a = 0; a < 3; a++) {
+        float near_plane = p.neg[a] ? node.max[a] : node.min[a];
+        float far_plane  = p.neg[a] ? node.min[a] : node.max[a];
+        float n = (near_plane - p.o[a][k]) * p.inv_d[a][k];
+        float f = (far_plane - p.o[a][k]) * p.inv_d[a][k] * (1.0f + 2.0f * BVH_FLOAT_GAMMA_3);
+        tn = n > tn ? n : tn;
+        tf = f < tf ? f : tf;
+      }
+      if (tn <= tf) hit |= 1u << k;
+    }
+#endif
+  }
+  return hit & mask;
+}
+
+/**
+ * Entry of the packet traversal stack: a node and the rays that still have
+ * to visit it.
+ */
+struct PacketStackEntry {
+  uint32_t node;
+  uint32_t mask;
+};
+
+template <bool any_hit>
+uint32_t BVHAccel::trace_packet(const Ray* rays, Intersection* isects, size_t n) const {
+  if (n == 0) return 0;
+  uint32_t all = n >= 32 ? ~0u : (1u << n) - 1;
+  uint32_t hits = 0;
+
+  // the frustum and the traversal order need one direction sign per axis,
+  // packets without one are traced ray by ray
+  bool coherent = true;
+  for (size_t k = 1; k < n && coherent; k++) {
+    for (int a = 0; a < 3; a++) {
+      if (rays[k].sign[a] != rays[0].sign[a]) coherent = false;
+    }
+  }
+  if (!coherent) {
+    for (size_t k = 0; k < n; k++) {
+      bool hit = any_hit ? has_intersection(rays[k]) : intersect(rays[k], &isects[k]);
+      if (hit) hits |= 1u << k;
+    }
+    return hits;
+  }
+
+  total_rays += n;
+
+  PacketRays p;
+  p.frustum = true;
+  p.t_min_lo = INF_F;
+  p.t_max_hi = -INF_F;
+  for (int a = 0; a < 3; a++) {
+    p.neg[a] = rays[0].sign[a];
+    p.o_lo[a] = p.inv_lo[a] = INF_F;
+    p.o_hi[a] = p.inv_hi[a] = -INF_F;
+  }
+  for (int k = 0; k < BVH_PACKET_SIZE; k++) {
+    // unused lanes get an empty segment
+    const Ray& r = rays[min<size_t>(k, n - 1)];
+    p.t_min[k] = k < (int)n ? (float)r.min_t : 1;
+    p.t_max[k] = k < (int)n ? (float)r.max_t : 0;
+    for (int a = 0; a < 3; a++) {
+      p.o[a][k] = (float)r.o[a];
+      p.inv_d[a][k] = (float)r.inv_d[a];
+      if (k >= (int)n) continue;
+      p.o_lo[a] = min(p.o_lo[a], p.o[a][k]);
+      p.o_hi[a] = max(p.o_hi[a], p.o[a][k]);
+      p.inv_lo[a] = min(p.inv_lo[a], p.inv_d[a][k]);
+      p.inv_hi[a] = max(p.inv_hi[a], p.inv_d[a][k]);
+      if (!std::isfinite(p.inv_d[a][k])) p.frustum = false;
+    }
+    if (k < (int)n) {
+      p.t_min_lo = min(p.t_min_lo, p.t_min[k]);
+      p.t_max_hi = max(p.t_max_hi, p.t_max[k]);
+    }
+  }
+
+  uint32_t done = 0;  // any hit: rays that already have a hit
+  PacketStackEntry stack[BVH_STACK_SIZE];
+  int stack_size = 0;
+  stack[stack_size++] = { 0, all };
+  while (stack_size > 0) {
+    PacketStackEntry e = stack[--stack_size];
+    uint32_t mask = e.mask & ~done;
+    if (!mask) continue;
+    const LinearBVHNode& node = nodes[e.node];
+    if (p.frustum && frustum_misses(node, p)) continue;
+    mask = intersect_rays(node, p, mask);
+    if (!mask) continue;
+
+    if (count_rays(mask) < BVH_PACKET_MIN_ACTIVE) {
+      for (int k = 0; k < (int)n; k++) {
+        if (!((mask >> k) & 1)) continue;
+        if (any_hit) {
+          if (has_intersection_from(e.node, rays[k])) {
+            hits |= 1u << k;
+            done |= 1u << k;
+          }
+        } else {
+          if (intersect_from(e.node, rays[k], &isects[k])) {
+            hits |= 1u << k;
+            p.t_max[k] = (float)rays[k].max_t;
+          }
+        }
+      }
+      if (any_hit && done == all) return hits;
+      continue;
+    }
+
+    if (node.isLeaf()) {
+      for (int k = 0; k < (int)n; k++) {
+        if (!((mask >> k) & 1)) continue;
+        if (any_hit) {
+          if (has_intersection_leaf(node.primitives_offset, node.n_primitives, rays[k])) {
+            hits |= 1u << k;
+            done |= 1u << k;
+          }
+        } else {
+          if (intersect_leaf(node.primitives_offset, node.n_primitives, rays[k], &isects[k])) {
+            hits |= 1u << k;
+            p.t_max[k] = (float)rays[k].max_t;
+          }
+        }
+      }
+      if (any_hit && done == all) return hits;
+      continue;
+    }
+
+    // the first child lies on the lower side of the split axis
+    uint32_t near_child = e.node + 1, far_child = node.second_child_offset;
+    if (p.neg[node.axis]) swap(near_child, far_child);
+    stack[stack_size++] = { far_child, mask };
+    stack[stack_size++] = { near_child, mask };
+  }
+  return hits;
+}
+
+uint32_t BVHAccel::intersect_packet(const Ray* rays, Intersection* isects, size_t n) const {
+  return trace_packet<false>(rays, isects, n);
+}
+
+uint32_t BVHAccel::has_intersection_packet(const Ray* rays, size_t n) const {
+  return trace_packet<true>(rays, NULL, n);
+}
+
+} // namespace SceneObjects
+} // namespace CGL
@@ -0,0 +1,362 @@
+#include "bvh.h"
+
+#include "CGL/CGL.h"
+
+#include <algorithm>
+#include <cassert>
+
+using namespace std;
+
+namespace CGL {
+namespace SceneObjects {
+
+// Number of buckets for object splits and of bins for spatial splits.
+static const int SBVH_NUM_BINS = 16;
+
+// Spatial splits are only tried in nodes where the children of the best
+// object split overlap by more than this fraction of the root surface area.
+static const double SBVH_OVERLAP_ALPHA = 1e-5;
+
+// Subtrees deeper than this are split at the median so that the tree stays
+// within the traversal stack size.
+static const size_t SBVH_MAX_DEPTH = 64;
+
+struct SBVHReference {
+  Primitive *primitive;  ///< referenced primitive
+  BBox bb;               ///< bounds of the part of the primitive in the node
+};
+
+struct SBVHSplit {
+  SBVHSplit() : cost(INF_D), axis(-1), bin(0) { }
+
+  double cost;  ///< SAH cost of the split, count * surface area summed
+  int axis;     ///< split axis, -1 if no valid split was found
+  int bin;      ///< the split lies after this bucket or bin
+  BBox left;    ///< bounds of the left child
+  BBox right;   ///< bounds of the right child
+};
+
+// Box with the given min and max along one axis, recomputing the extent.
+static inline BBox with_axis_range(const BBox &bb, int axis, double lo, double hi) {
+  Vector3D min = bb.min, max = bb.max;
+  min[axis] = lo;
+  max[axis] = hi;
+  return BBox(min, max);
+}
+
+static inline int bin_index(double x, double min, double extent) {
+  int b = (int)(SBVH_NUM_BINS * ((x - min) / extent));
+  return std::min(std::max(b, 0), SBVH_NUM_BINS - 1);
+}
+
+/**
+ * State of one spatial split BVH construction. Leaves append their
+ * references to ordered, which is reserved for the whole duplication budget
+ * up front so that the leaf iterators stay valid.
+ */
+struct SBVHBuilder {
+  size_t max_leaf_size;
+  size_t remaining;       ///< duplications left in the budget
+  double min_overlap;     ///< overlap area above which spatial splits are tried
+  vector<Primitive *> *ordered;
+
+  BVHNode *build(vector<SBVHReference> &refs, size_t depth);
+
+  SBVHSplit find_object_split(const vector<SBVHReference> &refs,
+                              const BBox &centroid_box) const;
+  SBVHSplit find_spatial_split(const vector<SBVHReference> &refs,
+                               const BBox &bb) const;
+
+  bool object_split(const vector<SBVHReference> &refs, const BBox &centroid_box,
+                    const SBVHSplit &split, vector<SBVHReference> &left,
+                    vector<SBVHReference> &right) const;
+  bool spatial_split(const vector<SBVHReference> &refs, const BBox &bb,
+                     const SBVHSplit &split, vector<SBVHReference> &left,
+                     vector<SBVHReference> &right);
+};
+
+SBVHSplit SBVHBuilder::find_object_split(const vector<SBVHReference> &refs,
+                                         const BBox &centroid_box) const {
+  SBVHSplit best;
+  for (int axis = 0; axis < 3; axis++) {
+    double min = centroid_box.min[axis], extent = centroid_box.extent[axis];
+    if (!(extent > 0)) continue;
+
+    size_t count[SBVH_NUM_BINS] = { 0 };
+    BBox bins[SBVH_NUM_BINS];
+    for (const SBVHReference &r : refs) {
+      int b = bin_index(r.bb.centroid()[axis], min, extent);
+      count[b]++;
+      bins[b].expand(r.bb);
+    }
+
+    // sweep from the right to get the bounds right of every split
+    BBox right_bb[SBVH_NUM_BINS];
+    size_t right_count[SBVH_NUM_BINS];
+    BBox acc;
+    size_t acc_count = 0;
+    for (int b = SBVH_NUM_BINS - 1; b > 0; b--) {
+      acc.expand(bins[b]);
+      acc_count += count[b];
+      right_bb[b] = acc;
+      right_count[b] = acc_count;
+    }
+
+    BBox left_bb;
+    size_t left_count = 0;
+    for (int b = 0; b < SBVH_NUM_BINS - 1; b++) {
+      left_bb.expand(bins[b]);
+      left_count += count[b];
+      if (left_count == 0 || right_count[b + 1] == 0) continue;
+      double cost = left_count * left_bb.surface_area() +
+                    right_count[b + 1] * right_bb[b + 1].surface_area();
+      if (cost < best.cost) {
+        best.cost = cost;
+        best.axis = axis;
+        best.bin = b;
+        best.left = left_bb;
+        best.right = right_bb[b + 1];
+      }
+    }
+  }
+  return best;
+}
+
+SBVHSplit SBVHBuilder::find_spatial_split(const vector<SBVHReference> &refs,
+                                          const BBox &bb) const {
+  SBVHSplit best;
+  for (int axis = 0; axis < 3; axis++) {
+    double min = bb.min[axis], extent = bb.extent[axis];
+    if (!(extent > 0)) continue;
+
+    // references enter the bin holding their min and exit the bin holding
+    // their max, and are clipped into every bin they span
+    size_t entries[SBVH_NUM_BINS] = { 0 }, exits[SBVH_NUM_BINS] = { 0 };
+    BBox bins[SBVH_NUM_BINS];
+    for (const SBVHReference &r : refs) {
+      int first = bin_index(r.bb.min[axis], min, extent);
+      int last = bin_index(r.bb.max[axis], min, extent);
+      entries[first]++;
+      exits[last]++;
+      if (first == last) {
+        bins[first].expand(r.bb);
+        continue;
+      }
+      for (int b = first; b <= last; b++) {
+        double lo = std::max(r.bb.min[axis], min + extent * b / SBVH_NUM_BINS);
+        double hi = std::min(r.bb.max[axis], min + extent * (b + 1) / SBVH_NUM_BINS);
+        bins[b].expand(r.primitive->get_clipped_bbox(with_axis_range(r.bb, axis, lo, hi)));
+      }
+    }
+
+    BBox right_bb[SBVH_NUM_BINS];
+    size_t right_count[SBVH_NUM_BINS];
+    BBox acc;
+    size_t acc_count = 0;
+    for (int b = SBVH_NUM_BINS - 1; b > 0; b--) {
+      acc.expand(bins[b]);
+      acc_count += exits[b];
+      right_bb[b] = acc;
+      right_count[b] = acc_count;
+    }
+
+    BBox left_bb;
+    size_t left_count = 0;
+    for (int b = 0; b < SBVH_NUM_BINS - 1; b++) {
+      left_bb.expand(bins[b]);
+      left_count += entries[b];
+      if (left_count == 0 || right_count[b + 1] == 0) continue;
+      double cost = left_count * left_bb.surface_area() +
+                    right_count[b + 1] * right_bb[b + 1].surface_area();
+      if (cost < best.cost) {
+        best.cost = cost;
+        best.axis = axis;
+        best.bin = b;
+        best.left = left_bb;
+        best.right = right_bb[b + 1];
+      }
+    }
+  }
+  return best;
+}
+
+bool SBVHBuilder::object_split(const vector<SBVHReference> &refs,
+                               const BBox &centroid_box, const SBVHSplit &split,
+                               vector<SBVHReference> &left,
+                               vector<SBVHReference> &right) const {
+  int axis = split.axis;
+  double min = centroid_box.min[axis], extent = centroid_box.extent[axis];
+  for (const SBVHReference &r : refs) {
+    if (bin_index(r.bb.centroid()[axis], min, extent) <= split.bin) {
+      left.push_back(r);
+    } else {
+      right.push_back(r);
+    }
+  }
+  return !left.empty() && !right.empty();
+}
+
+bool SBVHBuilder::spatial_split(const vector<SBVHReference> &refs,
+                                const BBox &bb, const SBVHSplit &split,
+                                vector<SBVHReference> &left,
+                                vector<SBVHReference> &right) {
+  int axis = split.axis;
+  double plane = bb.min[axis] + bb.extent[axis] * (split.bin + 1) / SBVH_NUM_BINS;
+
+  // references entirely on one side go there
+  BBox left_bb, right_bb;
+  vector<const SBVHReference *> straddling;
+  for (const SBVHReference &r : refs) {
+    if (r.bb.max[axis] <= plane) {
+      left.push_back(r);
+      left_bb.expand(r.bb);
+    } else if (r.bb.min[axis] >= plane) {
+      right.push_back(r);
+      right_bb.expand(r.bb);
+    } else {
+      straddling.push_back(&r);
+    }
+  }
+
+  // the others are split in two unless moving them wholly into one child is
+  // cheaper (reference unsplitting) or the budget is used up
+  size_t duplicated = 0;
+  for (const SBVHReference *r : straddling) {
+    SBVHReference l = *r, rr = *r;
+    l.bb = r->primitive->get_clipped_bbox(with_axis_range(r->bb, axis, r->bb.min[axis], plane));
+    rr.bb = r->primitive->get_clipped_bbox(with_axis_range(r->bb, axis, plane, r->bb.max[axis]));
+
+    size_t nl = left.size(), nr = right.size();
+    BBox left_with = left_bb, right_with = right_bb;
+    left_with.expand(r->bb);
+    right_with.expand(r->bb);
+    double cost_left = (nl + 1) * left_with.surface_area() + nr * right_bb.surface_area();
+    double cost_right = nl * left_bb.surface_area() + (nr + 1) * right_with.surface_area();
+    double cost_split = INF_D;
+    if (remaining > 0 && !l.bb.empty() && !rr.bb.empty()) {
+      BBox left_split = left_bb, right_split = right_bb;
+      left_split.expand(l.bb);
+      right_split.expand(rr.bb);
+      cost_split = (nl + 1) * left_split.surface_area() +
+                   (nr + 1) * right_split.surface_area();
+    }
+
+    if (cost_split < cost_left && cost_split < cost_right) {
+      left.push_back(l);
+      left_bb.expand(l.bb);
+      right.push_back(rr);
+      right_bb.expand(rr.bb);
+      remaining--;
+      duplicated++;
+    } else if (rr.bb.empty() || (!l.bb.empty() && cost_left <= cost_right)) {
+      left.push_back(*r);
+      left_bb.expand(r->bb);
+    } else {
+      right.push_back(*r);
+      right_bb.expand(r->bb);
+    }
+  }
+
+  if (left.empty() || right.empty()) {
+    remaining += duplicated;
+    left.clear();
+    right.clear();
+    return false;
+  }
+  return true;
+}
+
+BVHNode *SBVHBuilder::build(vector<SBVHReference> &refs, size_t depth) {
+  BBox bb, centroid_box;
+  for (const SBVHReference &r : refs) {
+    bb.expand(r.bb);
+    centroid_box.expand(r.bb.centroid());
+  }
+
+  BVHNode *node = new BVHNode(bb);
+  if (refs.size() <= max_leaf_size) {
+    size_t offset = ordered->size();
+    for (const SBVHReference &r : refs) {
+      ordered->push_back(r.primitive);
+    }
+    node->start = ordered->begin() + offset;
+    node->end = ordered->begin() + ordered->size();
+    return node;
+  }
+
+  vector<SBVHReference> left, right;
+  bool split = false;
+  if (depth < SBVH_MAX_DEPTH) {
+    SBVHSplit object = find_object_split(refs, centroid_box);
+    SBVHSplit spatial;
+    if (remaining > 0 && (object.axis < 0 ||
+        object.left.intersection(object.right).surface_area() > min_overlap)) {
+      spatial = find_spatial_split(refs, bb);
+    }
+    if (spatial.axis >= 0 && spatial.cost < object.cost) {
+      split = spatial_split(refs, bb, spatial, left, right);
+    }
+    if (!split && object.axis >= 0) {
+      split = object_split(refs, centroid_box, object, left, right);
+      if (!split) {
+        left.clear();
+        right.clear();
+      }
+    }
+  }
+
+  if (!split) {
+    // no useful split, divide at the centroid median of the longest axis
+    int axis = 0;
+    if (centroid_box.extent.y > centroid_box.extent[axis]) axis = 1;
+    if (centroid_box.extent.z > centroid_box.extent[axis]) axis = 2;
+    vector<SBVHReference>::iterator mid = refs.begin() + refs.size() / 2;
+    nth_element(refs.begin(), mid, refs.end(),
+                [axis](const SBVHReference &a, const SBVHReference &b) {
+      return a.bb.centroid()[axis] < b.bb.centroid()[axis];
+    });
+    left.assign(refs.begin(), mid);
+    right.assign(mid, refs.end());
+  }
+
+  // release the references of this node before recursing
+  vector<SBVHReference>().swap(refs);
+
+  node->l = build(left, depth + 1);
+  node->r = build(right, depth + 1);
+  return node;
+}
+
+BVHNode *BVHAccel::construct_sbvh(size_t max_leaf_size, double duplication_budget) {
+  size_t primitive_count = primitives.size();
+
+  vector<SBVHReference> refs(primitive_count);
+  BBox bb;
+  for (size_t i = 0; i < primitive_count; i++) {
+    refs[i].primitive = primitives[i];
+    refs[i].bb = primitives[i]->get_bbox();
+    bb.expand(refs[i].bb);
+  }
+
+  SBVHBuilder builder;
+  builder.max_leaf_size = max_leaf_size;
+  builder.remaining = (size_t)(std::max(duplication_budget, 0.0) * primitive_count);
+  builder.min_overlap = SBVH_OVERLAP_ALPHA * bb.surface_area();
+
+  // every duplication adds one reference, so this never reallocates
+  vector<Primitive *> ordered;
+  ordered.reserve(primitive_count + builder.remaining);
+  builder.ordered = &ordered;
+  Primitive **data = ordered.data();
+
+  BVHNode *root = builder.build(refs, 0);
+  assert(ordered.data() == data);
+  (void)data;
+
+  // swapping keeps the leaf iterators valid
+  primitives.swap(ordered);
+  return root;
+}
+
+} // namespace SceneObjects
+} // namespace CGL
@@ -0,0 +1,183 @@
+#include "bvh.h"
+
+#include "CGL/CGL.h"
+
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BVH_STREAM_SSE
+#endif
+
+using namespace std;
+
+namespace CGL {
+namespace SceneObjects {
+
+// Bits per axis of the origin cells the rays of a stream are sorted by.
+static const int BVH_STREAM_CELL_BITS = 10;
+
+/**
+ * Key that groups rays with the same direction octant and nearby origins:
+ * the octant in the top bits, then the Morton code of the origin cell.
+ */
+static inline uint64_t stream_sort_key(const Ray& r, const BBox& bb) {
+  uint64_t octant = (r.d.x < 0) | ((r.d.y < 0) << 1) | ((r.d.z < 0) << 2);
+  Vector3D extent = bb.extent;
+  uint32_t cell[3];
+  for (int a = 0; a < 3; a++) {
+    double u = extent[a] > 0 ? (r.o[a] - bb.min[a]) / extent[a] : 0;
+    u = clamp(u, 0.0, 1.0) * ((1 << BVH_STREAM_CELL_BITS) - 1);
+    cell[a] = (uint32_t)u;
+  }
+  uint64_t code = 0;
+  for (int b = BVH_STREAM_CELL_BITS - 1; b >= 0; b--) {
+    for (int a = 0; a < 3; a++) code = (code << 1) | ((cell[a] >> b) & 1);
+  }
+  return (octant << (3 * BVH_STREAM_CELL_BITS)) | code;
+}
+
+/**
+ * Structure of arrays copy of a ray stream, in sorted order.
+ */
+struct StreamRays {
+  vector<float> o[3];       ///< origins
+  vector<float> inv_d[3];   ///< inverse directions
+  vector<float> t_min;      ///< segment starts
+  vector<float> t_max;      ///< segment ends, shrink on hits
+  vector<uint32_t> id;      ///< index of the ray in the input array
+};
+
+/**
+ * Entry of the stream traversal stack: a node and the range of the lane
+ * buffer holding the rays that still have to visit it.
+ */
+struct StreamStackEntry {
+  uint32_t node;
+  uint32_t begin, end;
+};
+
+/**
+ * Append the rays in lanes [begin, end) that overlap the node bounds to
+ * the lane buffer, testing four of them at a time.
+ */
+static void filter_stream(const LinearBVHNode& node, const StreamRays& s,
+                          vector<uint32_t>& lanes, uint32_t begin, uint32_t end) {
+  for (uint32_t i = begin; i < end; i += 4) {
+    uint32_t n = min<uint32_t>(4, end - i);
+    uint32_t lane[4];
+    for (uint32_t j = 0; j < 4; j++) lane[j] = lanes[i + min(j, n - 1)];
+#ifdef BVH_STREAM_SSE
+    const __m128 scale = _mm_set1_ps(1.0f + 2.0f * BVH_FLOAT_GAMMA_3);
+    const __m128 zero = _mm_setzero_ps();
+    __m128 tn = _mm_set_ps(s.t_min[lane[3]], s.t_min[lane[2]], s.t_min[lane[1]], s.t_min[lane[0]]);
+    __m128 tf = _mm_set_ps(s.t_max[lane[3]], s.t_max[lane[2]], s.t_max[lane[1]], s.t_max[lane[0]]);
+    for (int a = 0; a < 3; a++) {
+      const float* so = s.o[a].data();
+      const float* si = s.inv_d[a].data();
+      __m128 o = _mm_set_ps(so[lane[3]], so[lane[2]], so[lane[1]], so[lane[0]]);
+      __m128 inv_d = _mm_set_ps(si[lane[3]], si[lane[2]], si[lane[1]], si[lane[0]]);
+      // the rays of a stream do not share direction signs, so pick the
+      // near and far planes per lane
+      __m128 neg = _mm_cmplt_ps(inv_d, zero);
+      __m128 lo = _mm_set1_ps(node.min[a]), hi = _mm_set1_ps(node.max[a]);
+      __m128 near_plane = _mm_or_ps(_mm_and_ps(neg, hi), _mm_andnot_ps(neg, lo));
+      __m128 far_plane  = _mm_or_ps(_mm_and_ps(neg, lo), _mm_andnot_ps(neg, hi));
+      __m128 t_near = _mm_mul_ps(_mm_sub_ps(near_plane, o), inv_d);
+      __m128 t_far  = _mm_mul_ps(_mm_sub_ps(far_plane, o), inv_d);
+      tn = _mm_max_ps(t_near, tn);
+      tf = _mm_min_ps(_mm_mul_ps(t_far, scale), tf);
+    }
+    int mask = _mm_movemask_ps(_mm_cmple_ps(tn, tf));
+#else
+    int mask = 0;
+    for (uint32_t j = 0; j < 4; j++) {
+      float tn = s.t_min[lane[j]], tf = s.t_max[lane[j]];
+      for (int a = 0; a < 3; a++) {
+        float inv_d = s.inv_d[a][lane[j]];
+        float near_plane = inv_d < 0 ? node.max[a] : node.min[a];
+        float far_plane  = inv_d < 0 ? node.min[a] : node.max[a];
+        float t_near = (near_plane - s.o[a][lane[j]]) * inv_d;
+        float t_far = (far_plane - s.o[a][lane[j]]) * inv_d * (1.0f + 2.0f * BVH_FLOAT_GAMMA_3);
+        tn = t_near > tn ? t_near : tn;
+        tf = t_far < tf ? t_far : tf;
+      }
+      if (tn <= tf) mask |= 1 << j;
+    }
+#endif
+    for (uint32_t j = 0; j < n; j++) {
+      if ((mask >> j) & 1) lanes.push_back(lane[j]);
+    }
+  }
+}
+
+void BVHAccel::intersect_stream(const Ray* rays, Intersection* isects, uint8_t* hits,
+                                size_t n) const {
+  if (n == 0) return;
+  total_rays += n;
+
+  vector<pair<uint64_t, uint32_t> > keys(n);
+  for (size_t k = 0; k < n; k++) {
+    keys[k] = make_pair(stream_sort_key(rays[k], bb), (uint32_t)k);
+    hits[k] = 0;
+  }
+  sort(keys.begin(), keys.end());
+
+  StreamRays s;
+  for (int a = 0; a < 3; a++) {
+    s.o[a].resize(n);
+    s.inv_d[a].resize(n);
+  }
+  s.t_min.resize(n);
+  s.t_max.resize(n);
+  s.id.resize(n);
+  vector<uint32_t> lanes(n);
+  for (size_t k = 0; k < n; k++) {
+    const Ray& r = rays[keys[k].second];
+    for (int a = 0; a < 3; a++) {
+      s.o[a][k] = (float)r.o[a];
+      s.inv_d[a][k] = (float)r.inv_d[a];
+    }
+    s.t_min[k] = (float)r.min_t;
+    s.t_max[k] = (float)r.max_t;
+    s.id[k] = keys[k].second;
+    lanes[k] = (uint32_t)k;
+  }
+
+  // The lane buffer works as a stack of ray lists. Both children of a node
+  // share the list of rays that overlapped it, and the lists appended while
+  // visiting the first child are dropped before visiting the second one.
+  StreamStackEntry stack[BVH_STACK_SIZE];
+  int stack_size = 0;
+  stack[stack_size++] = { 0, 0, (uint32_t)n };
+  while (stack_size > 0) {
+    StreamStackEntry e = stack[--stack_size];
+    lanes.resize(e.end);
+    const LinearBVHNode& node = nodes[e.node];
+
+    uint32_t begin = (uint32_t)lanes.size();
+    filter_stream(node, s, lanes, e.begin, e.end);
+    uint32_t end = (uint32_t)lanes.size();
+    if (begin == end) continue;
+
+    if (node.isLeaf()) {
+      for (uint32_t i = begin; i < end; i++) {
+        uint32_t lane = lanes[i], id = s.id[lane];
+        if (intersect_leaf(node.primitives_offset, node.n_primitives, rays[id], &isects[id])) {
+          hits[id] = 1;
+          s.t_max[lane] = (float)rays[id].max_t;
+        }
+      }
+      continue;
+    }
+
+    // rays are sorted by octant, so the first one usually speaks for all
+    uint32_t near_child = e.node + 1, far_child = node.second_child_offset;
+    if (s.inv_d[node.axis][lanes[begin]] < 0) swap(near_child, far_child);
+    stack[stack_size++] = { far_child, begin, end };
+    stack[stack_size++] = { near_child, begin, end };
+  }
+}
+
+} // namespace SceneObjects
+} // namespace CGL
@@ -0,0 +1,441 @@
+#include "bvh.h"
+
+#include "CGL/CGL.h"
+
+#include <cmath>
+#include <queue>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define BVH_WIDE_SSE
+#define BVH_WIDE_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BVH_WIDE_SSE
+#endif
+
+using namespace std;
+
+namespace CGL {
+namespace SceneObjects {
+
+static_assert(sizeof(WideBVHNode<4>) == 128, "WideBVHNode<4> should be 128 bytes");
+static_assert(sizeof(WideBVHNode<8>) == 256, "WideBVHNode<8> should be 256 bytes");
+static_assert(sizeof(QuantizedBVHNode<4>) == 80, "QuantizedBVHNode<4> should be 80 bytes");
+static_assert(sizeof(QuantizedBVHNode<8>) == 128, "QuantizedBVHNode<8> should be 128 bytes");
+
+// Size of the treelets the wide nodes are grouped into, a typical page.
+static const size_t BVH_TREELET_BYTES = 4096;
+
+template <int N>
+uint32_t BVHAccel::collapse(uint32_t node, WideBVHNodeVector<N>& wide_nodes) const {
+  // open the binary node, then keep opening the interior child with the
+  // largest surface area until all N slots are used
+  uint32_t children[N];
+  int n_children = 1;
+  children[0] = node;
+  while (n_children < N) {
+    int best = -1;
+    double best_area = -1;
+    for (int c = 0; c < n_children; c++) {
+      const LinearBVHNode& child = nodes[children[c]];
+      if (child.isLeaf()) continue;
+      double area = child.bbox().surface_area();
+      if (area > best_area) {
+        best = c;
+        best_area = area;
+      }
+    }
+    if (best < 0) break;
+
+    uint32_t opened = children[best];
+    children[best] = (uint32_t)left_child(opened);
+    children[n_children++] = (uint32_t)right_child(opened);
+  }
+
+  uint32_t index = (uint32_t)wide_nodes.size();
+  wide_nodes.push_back(WideBVHNode<N>());
+  WideBVHNode<N>& wide = wide_nodes[index];
+  wide.leaf_mask = 0;
+  for (int c = 0; c < N; c++) {
+    for (int a = 0; a < 3; a++) {
+      wide.min[a][c] = INF_F;
+      wide.max[a][c] = -INF_F;
+    }
+    wide.offset[c] = 0;
+    wide.n_primitives[c] = 0;
+  }
+  for (int c = 0; c < n_children; c++) {
+    const LinearBVHNode& child = nodes[children[c]];
+    for (int a = 0; a < 3; a++) {
+      wide.min[a][c] = child.min[a];
+      wide.max[a][c] = child.max[a];
+    }
+    if (child.isLeaf()) {
+      wide.leaf_mask |= (uint8_t)(1 << c);
+      wide.offset[c] = child.primitives_offset;
+      wide.n_primitives[c] = child.n_primitives;
+    }
+  }
+
+  // the vector may grow while building the children, so look the node up
+  // again after each one
+  for (int c = 0; c < n_children; c++) {
+    if (nodes[children[c]].isLeaf()) continue;
+    uint32_t child_index = collapse(children[c], wide_nodes);
+    wide_nodes[index].offset[c] = child_index;
+  }
+  return index;
+}
+
+template <int N>
+void BVHAccel::reorder_treelets(WideBVHNodeVector<N>& wide_nodes) {
+  if (wide_nodes.empty()) return;
+  const size_t treelet_size = max<size_t>(1, BVH_TREELET_BYTES / sizeof(WideBVHNode<N>));
+
+  // new position of every node, filled one treelet at a time. Treelet roots
+  // are taken depth first so that a treelet is close to its parent.
+  vector<uint32_t> order;
+  order.reserve(wide_nodes.size());
+  vector<uint32_t> roots(1, 0);
+  priority_queue<pair<float, uint32_t> > frontier;
+  while (!roots.empty()) {
+    frontier.push(make_pair(INF_F, roots.back()));
+    roots.pop_back();
+    size_t size = 0;
+    while (!frontier.empty() && size < treelet_size) {
+      uint32_t index = frontier.top().second;
+      frontier.pop();
+      order.push_back(index);
+      size++;
+
+      const WideBVHNode<N>& node = wide_nodes[index];
+      for (int c = 0; c < N; c++) {
+        if ((node.leaf_mask >> c) & 1) continue;
+        if (!(node.min[0][c] <= node.max[0][c])) continue;
+        float dx = node.max[0][c] - node.min[0][c];
+        float dy = node.max[1][c] - node.min[1][c];
+        float dz = node.max[2][c] - node.min[2][c];
+        frontier.push(make_pair(dx * dy + dy * dz + dz * dx, node.offset[c]));
+      }
+    }
+    // the largest of the remaining nodes is the next root
+    size_t first = roots.size();
+    while (!frontier.empty()) {
+      roots.push_back(frontier.top().second);
+      frontier.pop();
+    }
+    reverse(roots.begin() + first, roots.end());
+  }
+
+  vector<uint32_t> position(wide_nodes.size());
+  for (size_t i = 0; i < order.size(); i++) position[order[i]] = (uint32_t)i;
+
+  WideBVHNodeVector<N> reordered(wide_nodes.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    WideBVHNode<N>& node = reordered[i];
+    node = wide_nodes[order[i]];
+    for (int c = 0; c < N; c++) {
+      if ((node.leaf_mask >> c) & 1) continue;
+      if (!(node.min[0][c] <= node.max[0][c])) continue;
+      node.offset[c] = position[node.offset[c]];
+    }
+  }
+  wide_nodes.swap(reordered);
+}
+
+/**
+ * Dequantize a plane of a quantized node. The traversal computes the same
+ * product and sum in single precision, so it sees exactly this value.
+ */
+static inline float dequantize(float origin, float scale, int q) {
+  return origin + (float)q * scale;
+}
+
+template <int N>
+void BVHAccel::quantize(const WideBVHNodeVector<N>& wide_nodes,
+                        QuantizedBVHNodeVector<N>& quantized_nodes) {
+  quantized_nodes.resize(wide_nodes.size());
+  for (size_t i = 0; i < wide_nodes.size(); i++) {
+    const WideBVHNode<N>& wide = wide_nodes[i];
+    QuantizedBVHNode<N>& q = quantized_nodes[i];
+
+    // children with empty bounds are never hit, drop them
+    q.child_mask = 0;
+    for (int c = 0; c < N; c++) {
+      if (wide.min[0][c] <= wide.max[0][c] && wide.min[1][c] <= wide.max[1][c] &&
+          wide.min[2][c] <= wide.max[2][c]) {
+        q.child_mask |= (uint8_t)(1 << c);
+      }
+      q.offset[c] = wide.offset[c];
+      q.n_primitives[c] = wide.n_primitives[c];
+    }
+    q.leaf_mask = wide.leaf_mask;
+
+    for (int a = 0; a < 3; a++) {
+      float lo = INF_F, hi = -INF_F;
+      for (int c = 0; c < N; c++) {
+        if (!(q.child_mask & (1 << c))) continue;
+        lo = min(lo, wide.min[a][c]);
+        hi = max(hi, wide.max[a][c]);
+      }
+      if (!q.child_mask) lo = hi = 0;
+
+      // smallest power of two step that lets 255 steps cover the box
+      int exponent;
+      frexp((hi - lo) / 255.0f, &exponent);
+      float scale = ldexp(1.0f, exponent);
+      while (dequantize(lo, scale, 255) < hi) scale *= 2;
+      q.origin[a] = lo;
+      q.scale[a] = scale;
+
+      // round the planes outwards
+      for (int c = 0; c < N; c++) {
+        q.qmin[a][c] = 0;
+        q.qmax[a][c] = 0;
+        if (!(q.child_mask & (1 << c))) continue;
+        int qmin = (int)floor((wide.min[a][c] - lo) / scale);
+        int qmax = (int)ceil((wide.max[a][c] - lo) / scale);
+        qmin = clamp(qmin, 0, 255);
+        qmax = clamp(qmax, 0, 255);
+        while (qmin > 0 && dequantize(lo, scale, qmin) > wide.min[a][c]) qmin--;
+        while (qmax < 255 && dequantize(lo, scale, qmax) < wide.max[a][c]) qmax++;
+        q.qmin[a][c] = (uint8_t)qmin;
+        q.qmax[a][c] = (uint8_t)qmax;
+      }
+    }
+  }
+}
+
+/**
+ * Ray data shared by all the slab tests of one traversal.
+ */
+struct WideRay {
+  float o[3];       ///< origin
+  float inv_d[3];   ///< component wise inverse of the direction
+  int neg[3];       ///< 1 if the direction is negative along the axis
+};
+
+/**
+ * Ray - child bounds intersection for all N children of a wide node. The
+ * near and far planes are picked from the direction signs, and the min/max
+ * operand order makes NaNs (0 * inf) leave the interval untouched, as in
+ * LinearBVHNode::intersect.
+ * \param t_near entry distance of every child
+ * \return bit mask of the children overlapped by the ray within [t0, t1]
+ */
+template <int N>
+static inline int intersect_children(const WideBVHNode<N>& node, const WideRay& r,
+                                     float t0, float t1, float* t_near) {
+  int mask = 0;
+#ifdef BVH_WIDE_SSE
+  const __m128 scale = _mm_set1_ps(1.0f + 2.0f * BVH_FLOAT_GAMMA_3);
+  for (int g = 0; g < N; g += 4) {
+    __m128 tn = _mm_set1_ps(t0);
+    __m128 tf = _mm_set1_ps(t1);
+    for (int a = 0; a < 3; a++) {
+      __m128 o = _mm_set1_ps(r.o[a]);
+      __m128 inv_d = _mm_set1_ps(r.inv_d[a]);
+      const float* near_plane = r.neg[a] ? node.max[a] : node.min[a];
+      const float* far_plane  = r.neg[a] ? node.min[a] : node.max[a];
+      __m128 n = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_plane + g), o), inv_d);
+      __m128 f = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(far_plane + g), o), inv_d);
+      tn = _mm_max_ps(n, tn);
+      tf = _mm_min_ps(_mm_mul_ps(f, scale), tf);
+    }
+    _mm_storeu_ps(t_near + g, tn);
+    mask |= _mm_movemask_ps(_mm_cmple_ps(tn, tf)) << g;
+  }
+#else
+  for (int c = 0; c < N; c++) {
+    float tn = t0, tf = t1;
+    for (int a = 0; a < 3; a++) {
+      float near_plane = r.neg[a] ? node.max[a][c] : node.min[a][c];
+      float far_plane  = r.neg[a] ? node.min[a][c] : node.max[a][c];
+      float n = (near_plane - r.o[a]) * r.inv_d[a];
+      float f = (far_plane - r.o[a]) * r.inv_d[a] * (1.0f + 2.0f * BVH_FLOAT_GAMMA_3);
+      tn = n > tn ? n : tn;
+      tf = f < tf ? f : tf;
+    }
+    t_near[c] = tn;
+    if (tn <= tf) mask |= 1 << c;
+  }
+#endif
+  return mask;
+}
+
+#ifdef BVH_WIDE_AVX
+template <>
+inline int intersect_children<8>(const WideBVHNode<8>& node, const WideRay& r,
+                                 float t0, float t1, float* t_near) {
+  const __m256 scale = _mm256_set1_ps(1.0f + 2.0f * BVH_FLOAT_GAMMA_3);
+  __m256 tn = _mm256_set1_ps(t0);
+  __m256 tf = _mm256_set1_ps(t1);
+  for (int a = 0; a < 3; a++) {
+    __m256 o = _mm256_set1_ps(r.o[a]);
+    __m256 inv_d = _mm256_set1_ps(r.inv_d[a]);
+    const float* near_plane = r.neg[a] ? node.max[a] : node.min[a];
+    const float* far_plane  = r.neg[a] ? node.min[a] : node.max[a];
+    __m256 n = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(near_plane), o), inv_d);
+    __m256 f = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(far_plane), o), inv_d);
+    tn = _mm256_max_ps(n, tn);
+    tf = _mm256_min_ps(_mm256_mul_ps(f, scale), tf);
+  }
+  _mm256_storeu_ps(t_near, tn);
+  return _mm256_movemask_ps(_mm256_cmp_ps(tn, tf, _CMP_LE_OQ));
+}
+#endif
+
+#ifdef BVH_WIDE_SSE
+/**
+ * Convert four consecutive 8 bit values to floats.
+ */
+static inline __m128 load_quantized(const uint8_t* q) {
+  int32_t bytes;
+  memcpy(&bytes, q, sizeof(bytes));
+  const __m128i zero = _mm_setzero_si128();
+  __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+  return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+}
+#endif
+
+/**
+ * Ray - child bounds intersection for all N children of a quantized node.
+ * The child planes are dequantized in registers and then tested as in the
+ * float version.
+ */
+template <int N>
+static inline int intersect_children(const QuantizedBVHNode<N>& node, const WideRay& r,
+                                     float t0, float t1, float* t_near) {
+  int mask = 0;
+#ifdef BVH_WIDE_SSE
+  const __m128 scale = _mm_set1_ps(1.0f + 2.0f * BVH_FLOAT_GAMMA_3);
+  for (int g = 0; g < N; g += 4) {
+    __m128 tn = _mm_set1_ps(t0);
+    __m128 tf = _mm_set1_ps(t1);
+    for (int a = 0; a < 3; a++) {
+      __m128 o = _mm_set1_ps(r.o[a]);
+      __m128 inv_d = _mm_set1_ps(r.inv_d[a]);
+      __m128 origin = _mm_set1_ps(node.origin[a]);
+      __m128 step = _mm_set1_ps(node.scale[a]);
+      const uint8_t* near_plane = r.neg[a] ? node.qmax[a] : node.qmin[a];
+      const uint8_t* far_plane  = r.neg[a] ? node.qmin[a] : node.qmax[a];
+      __m128 np = _mm_add_ps(origin, _mm_mul_ps(load_quantized(near_plane + g), step));
+      __m128 fp = _mm_add_ps(origin, _mm_mul_ps(load_quantized(far_plane + g), step));
+      __m128 n = _mm_mul_ps(_mm_sub_ps(np, o), inv_d);
+      __m128 f = _mm_mul_ps(_mm_sub_ps(fp, o), inv_d);
+      tn = _mm_max_ps(n, tn);
+      tf = _mm_min_ps(_mm_mul_ps(f, scale), tf);
+    }
+    _mm_storeu_ps(t_near + g, tn);
+    mask |= _mm_movemask_ps(_mm_cmple_ps(tn, tf)) << g;
+  }
+#else
+  for (int c = 0; c < N; c++) {
+    float tn = t0, tf = t1;
+    for (int a = 0; a < 3; a++) {
+      int near_q = r.neg[a] ? node.qmax[a][c] : node.qmin[a][c];
+      int far_q  = r.neg[a] ? node.qmin[a][c] : node.qmax[a][c];
+      float near_plane = dequantize(node.origin[a], node.scale[a], near_q);
+      float far_plane  = dequantize(node.origin[a], node.scale[a], far_q);
+      float n = (near_plane - r.o[a]) * r.inv_d[a];
+      float f = (far_plane - r.o[a]) * r.inv_d[a] * (1.0f + 2.0f * BVH_FLOAT_GAMMA_3);
+      tn = n > tn ? n : tn;
+      tf = f < tf ? f : tf;
+    }
+    t_near[c] = tn;
+    if (tn <= tf) mask |= 1 << c;
+  }
+#endif
+  return mask & node.child_mask;
+}
+
+/**
+ * Entry of the wide traversal stack: a child that still has to be visited.
+ */
+struct WideStackEntry {
+  uint32_t offset;        ///< wide node index or first primitive
+  uint16_t n_primitives;  ///< leaf children: number of primitives
+  uint16_t leaf;          ///< non zero for leaf children
+  float t;                ///< distance at which the ray enters the child
+};
+
+template <typename Node, bool any_hit>
+bool BVHAccel::intersect_wide(const std::vector<Node, AlignedAllocator<Node, 64> >& wide_nodes,
+                              const Ray& ray, Intersection* i) const {
+  const int N = Node::width;
+  ++total_rays;
+
+  WideRay r;
+  for (int a = 0; a < 3; a++) {
+    r.o[a] = (float)ray.o[a];
+    r.inv_d[a] = (float)ray.inv_d[a];
+    r.neg[a] = ray.sign[a];
+  }
+
+  // every level pushes at most N entries, and the wide tree is no deeper
+  // than the binary one
+  WideStackEntry stack[BVH_STACK_SIZE * N];
+  int stack_size = 0;
+  bool hit = false;
+  uint32_t current = 0;
+  while (true) {
+    const Node& node = wide_nodes[current];
+    float t_near[N];
+    int mask = intersect_children(node, r, (float)ray.min_t, (float)ray.max_t, t_near);
+
+    // push the overlapped children, farthest first so that the nearest
+    // one is visited next
+    int first = stack_size;
+    for (int c = 0; c < N; c++) {
+      if (!(mask & (1 << c))) continue;
+      WideStackEntry e;
+      e.offset = node.offset[c];
+      e.n_primitives = node.n_primitives[c];
+      e.leaf = (node.leaf_mask >> c) & 1;
+      e.t = t_near[c];
+      int k = stack_size++;
+      if (!any_hit) {
+        for (; k > first && stack[k - 1].t < e.t; k--) stack[k] = stack[k - 1];
+      }
+      stack[k] = e;
+    }
+
+    // pop until the next interior child, testing leaves on the way
+    bool descend = false;
+    while (stack_size > 0) {
+      const WideStackEntry& e = stack[--stack_size];
+      if (e.t > ray.max_t) continue;
+      if (!e.leaf) {
+        current = e.offset;
+        descend = true;
+        break;
+      }
+      if (any_hit) {
+        if (has_intersection_leaf(e.offset, e.n_primitives, ray)) return true;
+      } else {
+        if (intersect_leaf(e.offset, e.n_primitives, ray, i)) hit = true;
+      }
+    }
+    if (!descend) break;
+  }
+  return hit;
+}
+
+template uint32_t BVHAccel::collapse<4>(uint32_t, WideBVHNodeVector<4>&) const;
+template uint32_t BVHAccel::collapse<8>(uint32_t, WideBVHNodeVector<8>&) const;
+template void BVHAccel::reorder_treelets<4>(WideBVHNodeVector<4>&);
+template void BVHAccel::reorder_treelets<8>(WideBVHNodeVector<8>&);
+template void BVHAccel::quantize<4>(const WideBVHNodeVector<4>&, QuantizedBVHNodeVector<4>&);
+template void BVHAccel::quantize<8>(const WideBVHNodeVector<8>&, QuantizedBVHNodeVector<8>&);
+template bool BVHAccel::intersect_wide<WideBVHNode<4>, true>(const WideBVHNodeVector<4>&, const Ray&, Intersection*) const;
+template bool BVHAccel::intersect_wide<WideBVHNode<4>, false>(const WideBVHNodeVector<4>&, const Ray&, Intersection*) const;
+template bool BVHAccel::intersect_wide<WideBVHNode<8>, true>(const WideBVHNodeVector<8>&, const Ray&, Intersection*) const;
+template bool BVHAccel::intersect_wide<WideBVHNode<8>, false>(const WideBVHNodeVector<8>&, const Ray&, Intersection*) const;
+template bool BVHAccel::intersect_wide<QuantizedBVHNode<4>, true>(const QuantizedBVHNodeVector<4>&, const Ray&, Intersection*) const;
+template bool BVHAccel::intersect_wide<QuantizedBVHNode<4>, false>(const QuantizedBVHNodeVector<4>&, const Ray&, Intersection*) const;
+template bool BVHAccel::intersect_wide<QuantizedBVHNode<8>, true>(const QuantizedBVHNodeVector<8>&, const Ray&, Intersection*) const;
+template bool BVHAccel::intersect_wide<QuantizedBVHNode<8>, false>(const QuantizedBVHNodeVector<8>&, const Ray&, Intersection*) const;
+
+} // namespace SceneObjects
+} // namespace CGL
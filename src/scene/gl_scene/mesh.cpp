@@ -19,7 +19,8 @@ static const double low_threshold  = .1;
 static const double mid_threshold  = .2;
 static const double high_threshold = 1.0 - low_threshold;
 
-Mesh::Mesh(Collada::PolymeshInfo& polyMesh, const Matrix4x4& transform) {
+Mesh::Mesh(Collada::PolymeshInfo& polyMesh, const Matrix4x4& transform)
+    : transform(transform), geometry_id(polyMesh.id) {
 
   // Build halfedge mesh from polygon soup
   vector< vector<size_t> > polygons;
@@ -532,7 +533,7 @@ BSDF* Mesh::get_bsdf() {
 }
 
 SceneObjects::SceneObject *Mesh::get_static_object() {
-  return new SceneObjects::Mesh(mesh, bsdf);
+  return new SceneObjects::Mesh(mesh, bsdf, transform, geometry_id);
 }
 
 
@@ -115,6 +115,10 @@ class Mesh : public SceneObject, public MeshView {
 
   // material
   BSDF* bsdf;
+
+  // placement of the source geometry, used to share it between instances
+  Matrix4x4 transform;
+  std::string geometry_id;
 };
 
 } // namespace GLScene
@@ -0,0 +1,69 @@
+#include "instance.h"
+
+#include "CGL/CGL.h"
+#include "GL/glew.h"
+
+namespace CGL {
+namespace SceneObjects {
+
+BVHInstance::BVHInstance(const BVHAccel *bvh, const Matrix4x4 &transform,
+                         BSDF *bsdf)
+    : bvh(bvh), transform(transform), inverse(transform.inv()),
+      normal_transform(inverse.T()), bsdf(bsdf) {
+
+  for (int c = 0; c < 4; c++) {
+    for (int r = 0; r < 4; r++) {
+      gl_transform[c * 4 + r] = transform(r, c);
+    }
+  }
+
+  // bound the transformed corners of the object space bounds
+  BBox object_bb = bvh->get_bbox();
+  if (object_bb.empty()) return;
+  for (int corner = 0; corner < 8; corner++) {
+    Vector3D p((corner & 1) ? object_bb.max.x : object_bb.min.x,
+               (corner & 2) ? object_bb.max.y : object_bb.min.y,
+               (corner & 4) ? object_bb.max.z : object_bb.min.z);
+    bb.expand((transform * Vector4D(p, 1)).projectTo3D());
+  }
+}
+
+bool BVHInstance::has_intersection(const Ray &r) const {
+  // the object space direction is not normalized so that t is the same in
+  // both spaces
+  Ray local = r.transform_by(inverse);
+  local.depth = r.depth;
+  local.min_t = r.min_t;
+  local.max_t = r.max_t;
+  return bvh->has_intersection(local);
+}
+
+bool BVHInstance::intersect(const Ray &r, Intersection *i) const {
+  Ray local = r.transform_by(inverse);
+  local.depth = r.depth;
+  local.min_t = r.min_t;
+  local.max_t = r.max_t;
+  if (!bvh->intersect(local, i)) return false;
+
+  r.max_t = local.max_t;
+  i->n = (normal_transform * Vector4D(i->n, 0)).to3D().unit();
+  if (bsdf) i->bsdf = bsdf;
+  return true;
+}
+
+void BVHInstance::draw(const Color &c, float alpha) const {
+  glPushMatrix();
+  glMultMatrixd(gl_transform);
+  bvh->draw(bvh->get_root(), c, alpha);
+  glPopMatrix();
+}
+
+void BVHInstance::drawOutline(const Color &c, float alpha) const {
+  glPushMatrix();
+  glMultMatrixd(gl_transform);
+  bvh->drawOutline(bvh->get_root(), c, alpha);
+  glPopMatrix();
+}
+
+} // namespace SceneObjects
+} // namespace CGL
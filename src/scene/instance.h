@@ -0,0 +1,83 @@
+#ifndef CGL_STATICSCENE_INSTANCE_H
+#define CGL_STATICSCENE_INSTANCE_H
+
+#include "bvh.h"
+#include "primitive.h"
+#include "CGL/matrix4x4.h"
+
+namespace CGL { namespace SceneObjects {
+
+/**
+ * A placed copy of a bottom-level BVH, used as a primitive of the top-level
+ * BVH of a two-level acceleration structure. The bottom-level BVH is built
+ * in object space and can be shared by any number of instances, each with
+ * its own object to world transform and surface material. Rays are mapped
+ * into object space instead of transforming the geometry.
+ */
+class BVHInstance : public Primitive {
+ public:
+
+  /**
+   * Parameterized Constructor.
+   * \param bvh shared object space BVH, kept alive by the caller
+   * \param transform object to world transform of the instance
+   * \param bsdf surface material of the instance, or NULL to keep the
+   *        material of the intersected primitive
+   */
+  BVHInstance(const BVHAccel* bvh, const Matrix4x4& transform, BSDF* bsdf);
+
+  /**
+   * Get the world space bounding box of the instance.
+   * \return world space bounding box of the instance
+   */
+  BBox get_bbox() const { return bb; }
+
+  /**
+   * Ray - Instance intersection, no intersection information is stored.
+   * \param r ray to test intersection with
+   * \return true if the given ray intersects with the instance,
+             false otherwise
+   */
+  bool has_intersection(const Ray& r) const;
+
+  /**
+   * Ray - Instance intersection 2.
+   * Intersects the shared BVH in object space and maps the intersection
+   * back to world space. The intersected primitive is the one in the shared
+   * BVH.
+   * \param r ray to test intersection with
+   * \param i address to store intersection info
+   * \return true if the given ray intersects with the instance,
+             false otherwise
+   */
+  bool intersect(const Ray& r, Intersection* i) const;
+
+  /**
+   * Get BSDF of the surface material of the instance.
+   */
+  BSDF* get_bsdf() const { return bsdf; }
+
+  /**
+   * Draw with OpenGL (for visualizer)
+   */
+  void draw(const Color& c, float alpha) const;
+
+  /**
+   * Draw outline with OpenGL (for visualizer)
+   */
+  void drawOutline(const Color& c, float alpha) const;
+
+ private:
+  const BVHAccel* bvh;  ///< shared object space BVH
+  Matrix4x4 transform;  ///< object to world transform
+  Matrix4x4 inverse;    ///< world to object transform
+  Matrix4x4 normal_transform;  ///< inverse transpose, maps normals to world space
+  double gl_transform[16];  ///< transform in OpenGL (column major) order
+  BBox bb;              ///< world space bounds
+  BSDF* bsdf;           ///< surface material of the instance
+};
+
+} // namespace SceneObjects
+} // namespace CGL
+
+#endif // CGL_STATICSCENE_INSTANCE_H
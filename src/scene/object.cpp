@@ -2,6 +2,7 @@
 #include "sphere.h"
 #include "triangle.h"
 
+#include <algorithm>
 #include <vector>
 #include <iostream>
 #include <unordered_map>
@@ -13,7 +14,10 @@ namespace CGL { namespace SceneObjects {
 
 // Mesh object //
 
-Mesh::Mesh(const HalfedgeMesh& mesh, BSDF* bsdf) {
+Mesh::Mesh(const HalfedgeMesh& mesh, BSDF* bsdf, const Matrix4x4& transform,
+           const std::string& geometry_id)
+    : num_vertices(0), transform(transform), geometry_id(geometry_id),
+      object_space(false) {
 
   unordered_map<const Vertex *, int> vertexLabels;
   vector<const Vertex *> verts;
@@ -26,11 +30,10 @@ Mesh::Mesh(const HalfedgeMesh& mesh, BSDF* bsdf) {
     vertexI++;
   }
 
-  positions = new Vector3D[vertexI];
-  normals   = new Vector3D[vertexI];
+  vector<Vector3D> vertexPositions(vertexI), vertexNormals(vertexI);
   for (int i = 0; i < vertexI; i++) {
-    positions[i] = verts[i]->position;
-    normals[i]   = verts[i]->normal;
+    vertexPositions[i] = verts[i]->position;
+    vertexNormals[i]   = verts[i]->normal;
   }
 
   for (FaceCIter f = mesh.facesBegin(); f != mesh.facesEnd(); f++) {
@@ -41,18 +44,45 @@ Mesh::Mesh(const HalfedgeMesh& mesh, BSDF* bsdf) {
   }
 
   this->bsdf = bsdf;
+  init(vertexPositions, vertexNormals);
 
 }
 
+Mesh::Mesh(const vector<Vector3D>& positions, const vector<Vector3D>& normals,
+           const vector<uint32_t>& indices, BSDF* bsdf)
+    : num_vertices(0), transform(Matrix4x4::identity()), object_space(false),
+      bsdf(bsdf), indices(indices) {
+  init(positions, normals);
+}
+
+void Mesh::init(const vector<Vector3D>& positions, const vector<Vector3D>& normals) {
+  num_vertices = positions.size();
+  this->positions.resize(3 * num_vertices);
+  this->normals.resize(3 * num_vertices);
+  for (size_t i = 0; i < num_vertices; i++) {
+    for (int a = 0; a < 3; a++) {
+      this->positions[3 * i + a] = (float)positions[i][a];
+      this->normals[3 * i + a] = (float)normals[i][a];
+    }
+  }
+
+  size_t num_triangles = indices.size() / 3;
+  triangles.reserve(num_triangles);
+  for (size_t i = 0; i < num_triangles; ++i) {
+    triangles.push_back(Triangle(this, i));
+  }
+}
+
+Mesh::~Mesh() { }
+
 vector<Primitive*> Mesh::get_primitives() const {
 
   vector<Primitive*> primitives;
   size_t num_triangles = indices.size() / 3;
+  primitives.reserve(num_triangles);
   for (size_t i = 0; i < num_triangles; ++i) {
-    Triangle* tri = new Triangle(this, indices[i * 3],
-                                       indices[i * 3 + 1],
-                                       indices[i * 3 + 2]);
-    primitives.push_back(tri);
+    // the primitive interface is not const, though tracing only reads it
+    primitives.push_back(const_cast<Triangle*>(&triangles[i]));
   }
   return primitives;
 }
@@ -61,6 +91,66 @@ BSDF* Mesh::get_bsdf() const {
   return bsdf;
 }
 
+void Mesh::to_object_space() {
+  if (object_space) return;
+
+  // normals transform with the inverse transpose, so they map back with
+  // the transpose
+  Matrix4x4 inverse = transform.inv();
+  Matrix4x4 transpose = transform.T();
+  for (size_t i = 0; i < num_vertices; i++) {
+    Vector3D p = (inverse * Vector4D(position(i), 1)).projectTo3D();
+    Vector3D n = (transpose * Vector4D(normal(i), 0)).to3D().unit();
+    for (int a = 0; a < 3; a++) {
+      positions[3 * i + a] = (float)p[a];
+      normals[3 * i + a] = (float)n[a];
+    }
+  }
+  object_space = true;
+}
+
+bool Mesh::same_geometry(const Mesh& other) const {
+  if (geometry_id.empty() || geometry_id != other.geometry_id) return false;
+  if (!object_space || !other.object_space) return false;
+  if (num_vertices != other.num_vertices || indices != other.indices) return false;
+
+  // allow for the rounding of the world space round trip, which is done
+  // on single precision positions
+  for (size_t i = 0; i < num_vertices; i++) {
+    double scale = std::max(1.0, position(i).norm());
+    if ((position(i) - other.position(i)).norm() > 1e-5 * scale) return false;
+  }
+  return true;
+}
+
+void Mesh::release_geometry() {
+  vector<float>().swap(positions);
+  vector<float>().swap(normals);
+  vector<uint32_t>().swap(indices);
+  vector<Triangle>().swap(triangles);
+  num_vertices = 0;
+}
+
+Mesh* Mesh::detach_geometry() {
+  Mesh* geometry = new Mesh(vector<Vector3D>(), vector<Vector3D>(),
+                            vector<uint32_t>(), bsdf);
+  geometry->positions.swap(positions);
+  geometry->normals.swap(normals);
+  geometry->indices.swap(indices);
+  geometry->num_vertices = num_vertices;
+  geometry->geometry_id = geometry_id;
+  geometry->object_space = object_space;
+
+  // the triangles point at their mesh, so the new mesh makes its own
+  size_t num_triangles = geometry->indices.size() / 3;
+  geometry->triangles.reserve(num_triangles);
+  for (size_t i = 0; i < num_triangles; ++i) {
+    geometry->triangles.push_back(Triangle(geometry, i));
+  }
+  release_geometry();
+  return geometry;
+}
+
 // Sphere object //
 
 SphereObject::SphereObject(const Vector3D o, double r, BSDF* bsdf) {
@@ -2,10 +2,15 @@
 #define CGL_STATICSCENE_OBJECT_H
 
 #include "util/halfEdgeMesh.h"
+#include "CGL/matrix4x4.h"
 #include "scene.h"
 
+#include <string>
+
 namespace CGL { namespace SceneObjects {
 
+class Triangle;
+
 /**
  * A triangle mesh object.
  */
@@ -17,12 +22,35 @@ class Mesh : public SceneObject {
    * Construct a static mesh for rendering from halfedge mesh used in editing.
    * Note that this converts the input halfedge mesh into a collection of
    * world-space triangle primitives.
+   * \param transform object to world transform the mesh was placed with
+   * \param geometry_id id of the source geometry, shared by all instances
+   *        of it, or empty if the mesh is not instanced
    */
-  Mesh(const HalfedgeMesh& mesh, BSDF* bsdf);
+  Mesh(const HalfedgeMesh& mesh, BSDF* bsdf,
+       const Matrix4x4& transform = Matrix4x4::identity(),
+       const std::string& geometry_id = "");
+
+  /**
+   * Constructor.
+   * Construct a static mesh from world space vertex attributes.
+   * \param positions vertex positions
+   * \param normals vertex normals, one per position
+   * \param indices vertex indices of the triangles, three per triangle
+   */
+  Mesh(const vector<Vector3D>& positions, const vector<Vector3D>& normals,
+       const vector<uint32_t>& indices, BSDF* bsdf);
+
+  // defined where Triangle is complete, as triangle.h includes this header
+  ~Mesh();
+
+  // the triangles point back at the mesh, so it stays where it was made
+  Mesh(const Mesh&) = delete;
+  Mesh& operator=(const Mesh&) = delete;
 
   /**
    * Get all the primitives (Triangle) in the mesh.
-   * Note that Triangle reference the mesh for the actual data.
+   * Note that Triangle reference the mesh for the actual data. The
+   * triangles are owned by the mesh, every call returns the same ones.
    * \return all the primitives in the mesh
    */
   vector<Primitive*> get_primitives() const;
@@ -33,14 +61,79 @@ class Mesh : public SceneObject {
    */
   BSDF* get_bsdf() const;
 
-  Vector3D *positions;  ///< position array
-  Vector3D *normals;    ///< normal array
+  /**
+   * Map the positions and normals back to object space through the inverse
+   * of the transform, so that the primitives can be shared by all the
+   * instances of the geometry. Does nothing if already done.
+   */
+  void to_object_space();
+
+  /**
+   * Check if this mesh and the given one are instances of the same geometry:
+   * they come from the same source geometry and still have the same
+   * triangles and object space vertices. Both meshes need to be in object
+   * space.
+   */
+  bool same_geometry(const Mesh& other) const;
+
+  /**
+   * Free the vertices, indices and triangles of a mesh that is rendered
+   * through the BVH of another instance of the same geometry. The mesh
+   * has no primitives afterwards.
+   */
+  void release_geometry();
+
+  /**
+   * Move the vertices, indices and triangles into a new mesh owned by the
+   * caller, which keeps the geometry id and object space flag, and release
+   * them here. Used to keep the geometry of a shared BVH alive once the
+   * scene that held the mesh is gone.
+   * \return new mesh with the geometry, with an identity transform
+   */
+  Mesh* detach_geometry();
+
+  /**
+   * Get the vertex indices of the triangles, three per triangle.
+   */
+  const vector<uint32_t>& get_indices() const { return indices; }
+
+  /**
+   * Get the position of a vertex.
+   */
+  Vector3D position(size_t v) const {
+    return Vector3D(positions[3 * v], positions[3 * v + 1], positions[3 * v + 2]);
+  }
+
+  /**
+   * Get the normal of a vertex.
+   */
+  Vector3D normal(size_t v) const {
+    return Vector3D(normals[3 * v], normals[3 * v + 1], normals[3 * v + 2]);
+  }
+
+  // Vertex attributes are kept in single precision, like the leaf triangles
+  // of the BVH, and shared by the triangles through their indices.
+  vector<float> positions;  ///< position array, three floats per vertex
+  vector<float> normals;    ///< normal array, three floats per vertex
+  size_t num_vertices;      ///< number of positions and normals
+
+  Matrix4x4 transform;      ///< object to world transform
+  std::string geometry_id;  ///< id of the source geometry, empty if unknown
+  bool object_space;        ///< positions and normals are in object space
 
  private:
 
   BSDF* bsdf; ///< BSDF of surface material
 
-  vector<size_t> indices;  ///< triangles defined by indices
+  vector<uint32_t> indices;  ///< triangles defined by indices
+
+  vector<Triangle> triangles;  ///< primitives of the triangles, one per index triple
+
+  /**
+   * Copy the attributes of the given vertices into the single precision
+   * arrays and create the triangles of the indices.
+   */
+  void init(const vector<Vector3D>& positions, const vector<Vector3D>& normals);
 
 };
 
@@ -20,10 +20,22 @@ class Primitive {
    */
   virtual BBox get_bbox() const = 0;
 
+  /**
+   * Get the world space bounding box of the part of the primitive inside
+   * the given box, as used by spatial splits. The default clips the bounding
+   * box of the whole primitive, which is conservative but not tight.
+   * \param clip box to clip the primitive to
+   * \return bounding box of the clipped primitive, empty if it is outside
+   */
+  virtual BBox get_clipped_bbox(const BBox& clip) const {
+    return get_bbox().intersection(clip);
+  }
+
   /**
    * Ray - Primitive intersection.
    * Check if the given ray intersects with the primitive, no intersection
-   * information is stored.
+   * information is stored and the ray is left untouched, so this is the
+   * cheaper test for shadow and visibility rays.
    * \param r ray to test intersection with
    * \return true if the given ray intersects with the primitive,
              false otherwise
@@ -9,12 +9,16 @@ namespace CGL {
 namespace SceneObjects {
 
 bool Sphere::test(const Ray &r, double &t1, double &t2) const {
+  return test(o, r2, r, t1, t2);
+}
+
+bool Sphere::test(const Vector3D &o, double r2, const Ray &r, double &t1, double &t2) {
 
   // TODO (Part 1.4):
   // Implement ray - sphere intersection test.
   // Return true if there are intersections and writing the
   // smaller of the two intersection times in t1 and the larger in t2.
-  double r_mag = dot(r.d, r.d), og_dir = 2.0f * dot((r.o - this->o), r.d), ogmag_rad = dot(r.o - this->o, r.o - this->o) - this->r2;
+  double r_mag = dot(r.d, r.d), og_dir = 2.0f * dot((r.o - o), r.d), ogmag_rad = dot(r.o - o, r.o - o) - r2;
   double diff = (og_dir * og_dir) - (4 * r_mag * ogmag_rad);
   if(diff <= 0) {
     return false;
@@ -25,7 +29,6 @@ bool Sphere::test(const Ray &r, double &t1, double &t2) const {
     t2 = t_low;
     double mint = min(t1, t2);
     if(mint >= r.min_t && mint <= r.max_t) {
-      r.max_t = mint;
       return true;
     }
     return false;
@@ -54,16 +57,21 @@ bool Sphere::intersect(const Ray &r, Intersection *i) const {
     return false;
   }
   else {
-    Vector3D prenorm = (t2 * r.d + r.o) - this->o;
-    prenorm.normalize();
-    i->n = prenorm;
-    i->t = t1;
-    i->bsdf = get_bsdf();
-    i->primitive = this;
+    set_intersection(r, t1, t2, i);
     return true;
   }
 }
 
+void Sphere::set_intersection(const Ray &r, double t1, double t2, Intersection *i) const {
+  r.max_t = min(t1, t2);
+  Vector3D prenorm = (t2 * r.d + r.o) - this->o;
+  prenorm.normalize();
+  i->n = prenorm;
+  i->t = t1;
+  i->bsdf = get_bsdf();
+  i->primitive = this;
+}
+
 void Sphere::draw(const Color &c, float alpha) const {
   Misc::draw_sphere_opengl(o, r, c);
 }
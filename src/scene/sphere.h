@@ -91,6 +91,22 @@ class Sphere : public Primitive {
    */
   bool test(const Ray& ray, double& t1, double& t2) const;
 
+  /**
+   * Sphere::test for a sphere given by its origin and squared radius, so
+   * that spheres stored by value can be tested without a Sphere object.
+   */
+  static bool test(const Vector3D& o, double r2, const Ray& ray,
+                   double& t1, double& t2);
+
+  /**
+   * Record a hit of the sphere found by test, as intersect does.
+   * \param r ray that hit the sphere, its max_t is set to the hit time
+   * \param t1 larger intersection time, as computed by test
+   * \param t2 smaller intersection time, as computed by test
+   * \param i address to store intersection info
+   */
+  void set_intersection(const Ray& r, double t1, double t2, Intersection* i) const;
+
   const SphereObject* object; ///< pointer to the sphere object
 
   Vector3D o; ///< origin of the sphere
@@ -6,75 +6,149 @@
 namespace CGL {
 namespace SceneObjects {
 
-Triangle::Triangle(const Mesh *mesh, size_t v1, size_t v2, size_t v3) {
-  p1 = mesh->positions[v1];
-  p2 = mesh->positions[v2];
-  p3 = mesh->positions[v3];
-  n1 = mesh->normals[v1];
-  n2 = mesh->normals[v2];
-  n3 = mesh->normals[v3];
-  bbox = BBox(p1);
-  bbox.expand(p2);
-  bbox.expand(p3);
-
-  bsdf = mesh->get_bsdf();
+Triangle::Triangle(const Mesh *mesh, size_t index)
+    : mesh(mesh), index((uint32_t)index) { }
+
+void Triangle::get_vertices(float p[3][3]) const {
+  for (int k = 0; k < 3; k++) {
+    const float *v = &mesh->positions[3 * vertex(k)];
+    p[k][0] = v[0];
+    p[k][1] = v[1];
+    p[k][2] = v[2];
+  }
+}
+
+BBox Triangle::get_bbox() const {
+  BBox bb(position(0));
+  bb.expand(position(1));
+  bb.expand(position(2));
+  return bb;
+}
+
+BBox Triangle::get_clipped_bbox(const BBox &clip) const {
+  // clip the triangle against the six planes of the box (Sutherland-Hodgman),
+  // each plane adds at most one vertex
+  Vector3D polygon[9], clipped[9];
+  int n = 3;
+  polygon[0] = position(0); polygon[1] = position(1); polygon[2] = position(2);
+
+  for (int axis = 0; axis < 3 && n > 0; axis++) {
+    for (int side = 0; side < 2 && n > 0; side++) {
+      double plane = side == 0 ? clip.min[axis] : clip.max[axis];
+      double sign = side == 0 ? 1.0 : -1.0;
+      int m = 0;
+      for (int i = 0; i < n; i++) {
+        const Vector3D &a = polygon[i], &b = polygon[(i + 1) % n];
+        double da = sign * (a[axis] - plane), db = sign * (b[axis] - plane);
+        if (da >= 0) clipped[m++] = a;
+        if ((da < 0 && db > 0) || (da > 0 && db < 0)) {
+          Vector3D p = a + (b - a) * (da / (da - db));
+          p[axis] = plane;
+          clipped[m++] = p;
+        }
+      }
+      n = m;
+      for (int i = 0; i < n; i++) polygon[i] = clipped[i];
+    }
+  }
+
+  BBox bb;
+  for (int i = 0; i < n; i++) bb.expand(polygon[i]);
+  // guards against the rounding of the clipped vertices
+  return bb.intersection(clip);
 }
 
-BBox Triangle::get_bbox() const { return bbox; }
+bool intersect_watertight(const float p[3][3], const Ray &r,
+                          float &t, float &bar1, float &bar2) {
+  const int kx = r.kx, ky = r.ky, kz = r.kz;
+
+  // vertices relative to the ray origin, sheared so that the ray runs
+  // along the kz axis
+  float x[3], y[3], z[3];
+  for (int j = 0; j < 3; j++) {
+    float a_x = p[j][kx] - (float)r.o[kx];
+    float a_y = p[j][ky] - (float)r.o[ky];
+    float a_z = p[j][kz] - (float)r.o[kz];
+    x[j] = a_x - r.shear[0] * a_z;
+    y[j] = a_y - r.shear[1] * a_z;
+    z[j] = r.shear[2] * a_z;
+  }
+
+  // edge functions, each the weight of the vertex opposite to its edge
+  float u = x[2] * y[1] - y[2] * x[1];
+  float v = x[0] * y[2] - y[0] * x[2];
+  float w = x[1] * y[0] - y[1] * x[0];
+
+  // the products of floats are exact in double, so the sign of an edge
+  // function the ray passes through is decided consistently for both
+  // triangles sharing the edge
+  if (u == 0 || v == 0 || w == 0) {
+    u = (float)((double)x[2] * y[1] - (double)y[2] * x[1]);
+    v = (float)((double)x[0] * y[2] - (double)y[0] * x[2]);
+    w = (float)((double)x[1] * y[0] - (double)y[1] * x[0]);
+  }
+
+  if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) return false;
+  float det = u + v + w;
+  if (det == 0) return false;
+
+  float inv_det = 1.0f / det;
+  float this_t = (u * z[0] + v * z[1] + w * z[2]) * inv_det;
+  if (!(this_t >= r.min_t && this_t <= r.max_t)) return false;
+  t = this_t;
+  bar1 = v * inv_det;
+  bar2 = w * inv_det;
+  return true;
+}
 
 bool Triangle::has_intersection(const Ray &r) const {
   // Part 1, Task 3: implement ray-triangle intersection
   // The difference between this function and the next function is that the next
   // function records the "intersection" while this function only tests whether
   // there is a intersection.
-  Vector3D edge_1 = p2 - p1, edge_2 = p3 - p1, ray_edge = r.o - p1;
-  Vector3D s1 = cross(r.d, edge_2), s2 = cross(ray_edge, edge_1);
-  Vector3D dots = Vector3D(dot(s2, edge_2), dot(s1, ray_edge), dot(s2, r.d));
-  Vector3D fin = 1 / dot(s1, edge_1) * dots;
-  double this_t = fin.x, bar1 = fin.y, bar2 = fin.z;
-  if(bar1 < 0 || bar2 < 0 || bar1 + bar2 > 1 || this_t < r.min_t || this_t > r.max_t) {
-    return false;
-  }
-  r.max_t = this_t;
-  return true;
+  float p[3][3], t, bar1, bar2;
+  get_vertices(p);
+  return intersect_watertight(p, r, t, bar1, bar2);
 }
 
 bool Triangle::intersect(const Ray &r, Intersection *isect) const {
   // Part 1, Task 3:
   // implement ray-triangle intersection. When an intersection takes
   // place, the Intersection data should be updated accordingly
-  Vector3D edge_1 = p2 - p1, edge_2 = p3 - p1, ray_edge = r.o - p1;
-  Vector3D s1 = cross(r.d, edge_2), s2 = cross(ray_edge, edge_1);
-  Vector3D dots = Vector3D(dot(s2, edge_2), dot(s1, ray_edge), dot(s2, r.d));
-  Vector3D fin = 1 / dot(s1, edge_1) * dots;
-  double this_t = fin.x, bar1 = fin.y, bar2 = fin.z;
-  if(bar1 < 0 || bar2 < 0 || bar1 + bar2 > 1 || this_t < r.min_t || this_t > r.max_t) {
-    return false;
-  }
+  float p[3][3], t, bar1, bar2;
+  get_vertices(p);
+  if (!intersect_watertight(p, r, t, bar1, bar2)) return false;
+  set_intersection(r, t, bar1, bar2, isect);
+  return true;
+}
+
+void Triangle::set_intersection(const Ray &r, double t, double bar1, double bar2,
+                                Intersection *isect) const {
   double bar3 = 1.0 - bar1 - bar2;
-  r.max_t = this_t;
-  isect->n = n1 * bar1 + n2 * bar2 + n3 * bar3;
-  isect->t = this_t;
+  r.max_t = t;
+  isect->n = normal(0) * bar1 + normal(1) * bar2 + normal(2) * bar3;
+  isect->t = t;
   isect->bsdf = get_bsdf();
   isect->primitive = this;
-  return true;
 }
 
 void Triangle::draw(const Color &c, float alpha) const {
   glColor4f(c.r, c.g, c.b, alpha);
   glBegin(GL_TRIANGLES);
-  glVertex3d(p1.x, p1.y, p1.z);
-  glVertex3d(p2.x, p2.y, p2.z);
-  glVertex3d(p3.x, p3.y, p3.z);
+  for (int k = 0; k < 3; k++) {
+    Vector3D p = position(k);
+    glVertex3d(p.x, p.y, p.z);
+  }
   glEnd();
 }
 
 void Triangle::drawOutline(const Color &c, float alpha) const {
   glColor4f(c.r, c.g, c.b, alpha);
   glBegin(GL_LINE_LOOP);
-  glVertex3d(p1.x, p1.y, p1.z);
-  glVertex3d(p2.x, p2.y, p2.z);
-  glVertex3d(p3.x, p3.y, p3.z);
+  for (int k = 0; k < 3; k++) {
+    Vector3D p = position(k);
+    glVertex3d(p.x, p.y, p.z);
+  }
   glEnd();
 }
 
@@ -6,6 +6,24 @@
 
 namespace CGL { namespace SceneObjects {
 
+/**
+ * Watertight ray - triangle intersection (Woop et al. 2013) in single
+ * precision, using the permutation and shear precomputed in the ray. The
+ * edge functions are evaluated relative to the ray, so a ray through an
+ * edge or vertex shared by several triangles hits at least one of them,
+ * and exact zeros are decided again in double precision. Both sides of the
+ * triangle are hit and degenerate triangles never are.
+ * \param p the three vertices of the triangle, per vertex and axis
+ * \param r ray to test intersection with, only hits within [min_t, max_t]
+ *        are reported
+ * \param t time of intersection
+ * \param bar1 barycentric coordinate of the second vertex
+ * \param bar2 barycentric coordinate of the third vertex
+ * \return true if the ray hits the triangle
+ */
+bool intersect_watertight(const float p[3][3], const Ray& r,
+                          float& t, float& bar1, float& bar2);
+
 /**
  * A single triangle from a mesh.
  * To save space, it holds a pointer back to the data in the original mesh
@@ -18,15 +36,13 @@ public:
 
   /**
    * Constructor.
-   * Construct a mesh triangle with the given indicies into the triangle mesh.
+   * Construct a reference to a triangle of the triangle mesh.
    * \param mesh pointer to the mesh the triangle is in
-   * \param v1 index of triangle vertex in the mesh's attribute arrays
-   * \param v2 index of triangle vertex in the mesh's attribute arrays
-   * \param v3 index of triangle vertex in the mesh's attribute arrays
+   * \param index index of the triangle in the mesh's index triples
    */
-  Triangle(const Mesh* mesh, size_t v1, size_t v2, size_t v3);
+  Triangle(const Mesh* mesh, size_t index);
 
-  Triangle() {};
+  Triangle() : mesh(NULL), index(0) {};
 
   /**
    * Get the world space bounding box of the triangle.
@@ -34,6 +50,14 @@ public:
    */
   BBox get_bbox() const;
 
+  /**
+   * Get the world space bounding box of the part of the triangle inside
+   * the given box.
+   * \param clip box to clip the triangle to
+   * \return bounding box of the clipped triangle, empty if it is outside
+   */
+  BBox get_clipped_bbox(const BBox& clip) const;
+
   /**
    * Ray - Triangle intersection.
    * Check if the given ray intersects with the triangle, no intersection
@@ -56,12 +80,42 @@ public:
    */
   bool intersect(const Ray& r, Intersection* i) const;
 
+  /**
+   * Record a hit of the triangle found by a batched test, as intersect does
+   * when it finds one.
+   * \param r ray that hit the triangle, its max_t is set to t
+   * \param t time of intersection
+   * \param bar1 barycentric coordinate of the second vertex
+   * \param bar2 barycentric coordinate of the third vertex
+   * \param i address to store intersection info
+   */
+  void set_intersection(const Ray& r, double t, double bar1, double bar2,
+                        Intersection* i) const;
+
+  /**
+   * Get the vertices in single precision, as stored in the mesh.
+   * \param p the three vertices of the triangle, per vertex and axis
+   */
+  void get_vertices(float p[3][3]) const;
+
+  /**
+   * Get a vertex position.
+   * \param k vertex of the triangle, 0 to 2
+   */
+  Vector3D position(int k) const { return mesh->position(vertex(k)); }
+
+  /**
+   * Get a vertex normal.
+   * \param k vertex of the triangle, 0 to 2
+   */
+  Vector3D normal(int k) const { return mesh->normal(vertex(k)); }
+
   /**
    * Get BSDF.
    * In the case of a triangle, the surface material BSDF is stored in 
    * the mesh it belongs to. 
    */
-  BSDF* get_bsdf() const { return bsdf; }
+  BSDF* get_bsdf() const { return mesh->get_bsdf(); }
 
   /**
    * Draw with OpenGL (for visualizer)
@@ -73,12 +127,16 @@ public:
    */
   void drawOutline(const Color& c, float alpha) const;
 
-  Vector3D p1, p2, p3;
-  Vector3D n1, n2, n3;
-  
-  BSDF* bsdf;
+  const Mesh* mesh;  ///< mesh holding the vertex attributes
+  uint32_t index;    ///< index of the triangle in the mesh
+
+private:
+
+  /**
+   * Index of a vertex of the triangle in the mesh's attribute arrays.
+   */
+  uint32_t vertex(int k) const { return mesh->get_indices()[3 * index + k]; }
 
-  BBox bbox;
 }; // class Triangle
 
 } // namespace SceneObjects
@@ -0,0 +1,67 @@
+#ifndef CGL_ALIGNED_ALLOCATOR_H
+#define CGL_ALIGNED_ALLOCATOR_H
+
+#include <cstdlib>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+namespace CGL {
+
+/**
+ * STL allocator that returns memory aligned to the given number of bytes,
+ * e.g. to start arrays of small nodes on a cache line boundary.
+ * \tparam T type of the allocated elements
+ * \tparam Alignment alignment in bytes, a power of two multiple of
+ *         sizeof(void*)
+ */
+template <class T, size_t Alignment>
+struct AlignedAllocator {
+  typedef T value_type;
+
+  template <class U>
+  struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+  AlignedAllocator() { }
+
+  template <class U>
+  AlignedAllocator(const AlignedAllocator<U, Alignment>&) { }
+
+  T* allocate(size_t n) {
+    if (n == 0) return NULL;
+    void* p = NULL;
+#ifdef _WIN32
+    p = _aligned_malloc(n * sizeof(T), Alignment);
+#else
+    if (posix_memalign(&p, Alignment, n * sizeof(T)) != 0) p = NULL;
+#endif
+    if (!p) throw std::bad_alloc();
+    return static_cast<T*>(p);
+  }
+
+  void deallocate(T* p, size_t) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+  }
+};
+
+template <class T, class U, size_t Alignment>
+bool operator==(const AlignedAllocator<T, Alignment>&,
+                const AlignedAllocator<U, Alignment>&) {
+  return true;
+}
+
+template <class T, class U, size_t Alignment>
+bool operator!=(const AlignedAllocator<T, Alignment>&,
+                const AlignedAllocator<U, Alignment>&) {
+  return false;
+}
+
+} // namespace CGL
+
+#endif // CGL_ALIGNED_ALLOCATOR_H
@@ -0,0 +1,45 @@
+#ifndef CGL_PARALLEL_H
+#define CGL_PARALLEL_H
+
+#include <thread>
+#include <vector>
+
+namespace CGL {
+
+/**
+ * Split [begin, end) into num_chunks contiguous chunks and run
+ * f(chunk, chunk_begin, chunk_end) on each of them, one thread per chunk.
+ * The calling thread processes the first chunk itself. Chunk boundaries only
+ * depend on the range and the number of chunks, so successive calls with the
+ * same arguments visit the same elements in every chunk.
+ * \param begin first index of the range
+ * \param end one past the last index of the range
+ * \param num_chunks number of chunks (and threads) to use
+ * \param f function called as f(size_t chunk, size_t begin, size_t end)
+ */
+template <class F>
+void parallel_for(size_t begin, size_t end, size_t num_chunks, const F& f) {
+  size_t count = end - begin;
+  if (num_chunks > count) num_chunks = count;
+  if (num_chunks <= 1) {
+    f(0, begin, end);
+    return;
+  }
+
+  std::vector<std::thread> threads;
+  threads.reserve(num_chunks - 1);
+  for (size_t c = 1; c < num_chunks; c++) {
+    size_t b = begin + count * c / num_chunks;
+    size_t e = begin + count * (c + 1) / num_chunks;
+    threads.push_back(std::thread([&f, c, b, e] { f(c, b, e); }));
+  }
+  f(0, begin, begin + count / num_chunks);
+
+  for (std::thread& t : threads) {
+    t.join();
+  }
+}
+
+} // namespace CGL
+
+#endif // CGL_PARALLEL_H
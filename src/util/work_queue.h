@@ -1,52 +1,107 @@
 #ifndef __WORK_QUEUE_H__
 #define __WORK_QUEUE_H__
 
-#include <mutex>
+#include <atomic>
+#include <cstdint>
 #include <vector>
 
+#include "util/aligned_allocator.h"
+
 /**
+ * Lock free work stealing queue for batch processing. All the work is
+ * assigned up front and split into one contiguous run per worker. A worker
+ * takes items from the front of its own run, and once that is empty, steals
+ * them from the back of the runs of the other workers, so that neighbouring
+ * items mostly stay on the same worker.
+ *
  * Note that this queue has no wait-until-more-work-is-added capability; it's
  * intended for more isolated or batch-processing-like situations.
  */
 template <class T>
-class WorkQueue {
+class WorkStealingQueue {
  private:
-  std::vector<T> storage;
-  std::mutex lock;
 
- public:
+  /**
+   * Remaining range of the items of a worker, the begin index in the low and
+   * the end index in the high 32 bits, so that the owner and the thieves
+   * agree on it with a single compare and swap. Each run has a cache line
+   * of its own.
+   */
+  struct alignas(64) Run {
+    std::atomic<uint64_t> range;
+  };
 
-  WorkQueue() {}
+  std::vector<T> storage;
+  std::vector<Run, CGL::AlignedAllocator<Run, 64> > runs;
+  size_t num_runs;
 
-  bool is_empty() {
-    lock.lock();
-    bool result = storage.empty();
-    lock.unlock();
-    return result;
+  static uint64_t pack(uint32_t begin, uint32_t end) {
+    return (uint64_t)end << 32 | begin;
   }
 
-  bool try_get_work(T *outPtr) {
-    lock.lock();
-    if (storage.empty()) {
-      lock.unlock();
-      return false;
+  /**
+   * Take the first (or the last) item of a run.
+   * \return false if the run is empty
+   */
+  bool take(Run& run, bool from_back, T *outPtr) {
+    uint64_t range = run.range.load(std::memory_order_relaxed);
+    while (true) {
+      uint32_t begin = (uint32_t)range, end = (uint32_t)(range >> 32);
+      if (begin >= end) return false;
+      uint32_t index = from_back ? end - 1 : begin;
+      uint64_t next = from_back ? pack(begin, end - 1) : pack(begin + 1, end);
+      if (run.range.compare_exchange_weak(range, next, std::memory_order_acquire,
+                                          std::memory_order_relaxed)) {
+        *outPtr = storage[index];
+        return true;
+      }
     }
-    *outPtr = storage.front();
-    storage.erase(storage.begin());
-    lock.unlock();
-    return true;
   }
 
-  void put_work(const T& item) {
-    lock.lock();
-    storage.push_back(item);
-    lock.unlock();
+ public:
+
+  WorkStealingQueue() : num_runs(0) {}
+
+  /**
+   * Replace the work with the given items, in order, split into contiguous
+   * runs of the given number of workers. Must not be called while workers
+   * are getting work.
+   */
+  void assign(const std::vector<T>& items, size_t num_workers) {
+    storage = items;
+    if (num_workers != num_runs) {
+      // runs are not movable, so the vector is replaced rather than resized
+      std::vector<Run, CGL::AlignedAllocator<Run, 64> >(num_workers).swap(runs);
+      num_runs = num_workers;
+    }
+    for (size_t w = 0; w < num_runs; w++) {
+      uint32_t begin = (uint32_t)(storage.size() * w / num_runs);
+      uint32_t end = (uint32_t)(storage.size() * (w + 1) / num_runs);
+      runs[w].range.store(pack(begin, end), std::memory_order_release);
+    }
+  }
+
+  /**
+   * Get the next item of a worker: the front of its own run, or else the
+   * back of the run of another worker.
+   * \param worker index of the worker, less than the number of workers
+   * \return false if there is no work left
+   */
+  bool try_get_work(size_t worker, T *outPtr) {
+    if (take(runs[worker], false, outPtr)) return true;
+    for (size_t k = 1; k < num_runs; k++) {
+      if (take(runs[(worker + k) % num_runs], true, outPtr)) return true;
+    }
+    return false;
   }
 
+  /**
+   * Drop the work that has not been taken yet.
+   */
   void clear() {
-    lock.lock();
-    storage.clear();
-    lock.unlock();
+    for (size_t w = 0; w < num_runs; w++) {
+      runs[w].range.store(0, std::memory_order_relaxed);
+    }
   }
 };
 